@@ -0,0 +1,252 @@
+//
+// File:   bench-compare.cpp
+//
+// Verdict on two benchmark runs. Reads the bench_output.txt of a baseline and of a candidate
+// (inotify-bench.cpp appends one line of key=value pairs per trial), groups the lines by what
+// was measured (every non-numeric field, e.g. bench, workload and backend, plus suppress) and
+// compares every numeric metric across the trials of each group:
+//
+//    delta      difference of the means, relative to the baseline
+//    95% CI     confidence interval of that difference (Welch's t, unequal variances)
+//
+// A metric regresses when it got worse by more than the threshold and the interval doesn't
+// include zero, i.e. the change is both large and not explained by trial-to-trial noise.
+// With a single trial on either side there is no interval, and the threshold alone decides.
+// Every metric the bench writes has a direction here: lower or higher is better, or it only
+// describes the workload (events, dirs, ...) and is shown but never judged. Pass/fail fields
+// (ok, fresh_equal, ...) and counts of wrong answers are correctness gates: any drop of the
+// one, or rise of the other, is a regression whatever the noise. A metric not listed at all
+// is an error, so the lists can't silently fall behind the bench.
+//
+// This code sample is released into the Public Domain.
+//
+//
+// To compile:
+//    $ g++ -O2 bench-compare.cpp -o bench-compare
+//
+// To run:
+//    $ ./bench-compare [-t threshold%] [-a] baseline.txt candidate.txt
+//
+// -a prints every metric, not only the ones that changed significantly. Exits with 1 if
+// anything regressed, 2 on errors, 0 otherwise.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+using std::string;
+using std::vector;
+using std::map;
+
+typedef map<string, vector<double> > samples;      // metric -> one value per trial
+
+// Fields that identify a measurement although they are numbers, numbers that only describe
+// the workload, and the direction of everything else.
+static const char *identity[] = {"suppress", "dead_writer"};
+static const char *informational[] = {"trial", "dirs", "events", "generated", "changed", "dropped",
+                                      "unavailable", "quiet_events", "flood_events", "entries", "added",
+                                      "removed", "subs", "churned", "tree", "expected", "diffs",
+                                      "identical_diffs", "shared_create", "shared_delete", "released_create",
+                                      "released_other"};
+static const char *higher_better[] = {"events_per_s", "delivered", "quiet_delivered", "flood_delivered"};
+static const char *lower_better[] = {"setup_ms", "cpu_pct", "p50_us", "p90_us", "p99_us", "p999_us", "max_us",
+                                     "loss_pct", "allocs_per_event", "user_kb", "kernel_kb", "bytes_per_watch",
+                                     "overflows", "amplification", "mark_ns", "collect_us", "lookup_ns",
+                                     "give_up_ms", "diff_ms", "ns_per_entry", "bytes_per_entry", "add_us",
+                                     "warm_ns", "cold_ns", "cache", "compared", "identical_compared", "diff_us"};
+// Correctness gates: 1 when a check passed, and counts of wrong answers.
+static const char *passed[] = {"ok", "fresh_equal", "same_wd", "gave_up"};
+static const char *failed[] = {"wrong"};
+
+static bool listed (const char *const *list, size_t n, const string &key)
+{
+    for (size_t i = 0; i < n; i++)
+        if (key == list[i])
+            return true;
+    return false;
+}
+#define LISTED(list, key) listed (list, sizeof (list) / sizeof (list[0]), key)
+
+static bool known (const string &key)
+{
+    return LISTED (informational, key) || LISTED (higher_better, key) || LISTED (lower_better, key) ||
+        LISTED (passed, key) || LISTED (failed, key);
+}
+
+static bool number (const string &s, double *v)
+{
+    char *end;
+    *v = strtod (s.c_str(), &end);
+    return !s.empty() && *end == '\0';
+}
+
+// Read a bench output file into group -> metric -> samples.
+static bool load (const char *path, map<string, samples> &groups)
+{
+    FILE *f = fopen (path, "r");
+    if (!f) {
+        perror (path);
+        return false;
+    }
+    char line[4096];
+    while (fgets (line, sizeof (line), f)) {
+        string group;
+        vector<std::pair<string, double> > metrics;
+        for (char *tok = strtok (line, " \t\n"); tok; tok = strtok (NULL, " \t\n")) {
+            char *eq = strchr (tok, '=');
+            if (!eq)
+                continue;
+            string key (tok, eq - tok), value (eq + 1);
+            double v;
+            if (!number (value, &v) || LISTED (identity, key)) {
+                group += (group.empty() ? "" : " ") + key + "=" + value;
+            } else if (known (key)) {
+                metrics.push_back (std::make_pair (key, v));
+            } else {
+                fprintf (stderr, "%s: unknown metric %s, add it to bench-compare.cpp\n", path, key.c_str());
+                fclose (f);
+                return false;
+            }
+        }
+        if (group.empty())
+            continue;
+        samples &s = groups[group];
+        for (size_t i = 0; i < metrics.size(); i++)
+            s[metrics[i].first].push_back (metrics[i].second);
+    }
+    fclose (f);
+    return true;
+}
+
+static void moments (const vector<double> &x, double *mean, double *var)
+{
+    double sum = 0, sq = 0;
+    for (size_t i = 0; i < x.size(); i++)
+        sum += x[i];
+    *mean = sum / x.size();
+    for (size_t i = 0; i < x.size(); i++)
+        sq += (x[i] - *mean) * (x[i] - *mean);
+    *var = x.size() > 1 ? sq / (x.size() - 1) : 0;
+}
+
+// Two-sided 95% quantile of Student's t with df degrees of freedom.
+static double t95 (double df)
+{
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1)
+        return table[0];
+    if (df <= 30)
+        return table[(int) df - 1];
+    return 1.96 + 2.4 / df;
+}
+
+struct verdict {
+    double delta;       // relative change of the mean, candidate vs baseline
+    double lo, hi;      // 95% CI of the relative change; lo > hi when there is none
+    bool regressed;
+    bool improved;
+};
+
+static verdict compare (const string &metric, const vector<double> &a, const vector<double> &b, double threshold)
+{
+    double ma, va, mb, vb;
+    moments (a, &ma, &va);
+    moments (b, &mb, &vb);
+    double scale = fabs (ma) > 1e-12 ? fabs (ma) : 1;
+    verdict v = {(mb - ma) / scale, 1, 0, false, false};
+    bool ci = a.size() > 1 && b.size() > 1;
+    bool significant = true;
+    if (ci) {
+        double sa = va / a.size(), sb = vb / b.size();
+        double se = sqrt (sa + sb);
+        double df = sa + sb > 0 ? (sa + sb) * (sa + sb) /
+            (sa * sa / (a.size() - 1) + sb * sb / (b.size() - 1)) : 1e9;
+        double half = t95 (df) * se / scale;
+        v.lo = v.delta - half;
+        v.hi = v.delta + half;
+        significant = v.lo > 0 || v.hi < 0;
+    }
+    if (LISTED (passed, metric) || LISTED (failed, metric)) {
+        v.regressed = LISTED (passed, metric) ? mb < ma : mb > ma;
+        v.improved = LISTED (passed, metric) ? mb > ma : mb < ma;
+        return v;
+    }
+    if (LISTED (informational, metric) || !significant)
+        return v;
+    double worse = LISTED (higher_better, metric) ? -v.delta : v.delta;
+    v.regressed = worse > threshold;
+    v.improved = worse < -threshold;
+    return v;
+}
+
+int main (int argc, char *argv[])
+{
+    double threshold = 10;
+    bool all = false;
+    int opt;
+    while ((opt = getopt (argc, argv, "t:a")) != -1) {
+        switch (opt) {
+        case 't': threshold = atof (optarg); break;
+        case 'a': all = true; break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf (stderr, "usage: %s [-t threshold%%] [-a] baseline.txt candidate.txt\n", argv[0]);
+        return 2;
+    }
+    map<string, samples> base, cand;
+    if (!load (argv[optind], base) || !load (argv[optind + 1], cand))
+        return 2;
+
+    int regressions = 0, improvements = 0, compared = 0;
+    for (map<string, samples>::iterator gi = base.begin(); gi != base.end(); gi++) {
+        map<string, samples>::iterator ci = cand.find (gi->first);
+        if (ci == cand.end()) {
+            printf ("%s: missing from candidate\n", gi->first.c_str());
+            continue;
+        }
+        bool header = false;
+        for (samples::iterator mi = gi->second.begin(); mi != gi->second.end(); mi++) {
+            samples::iterator ni = ci->second.find (mi->first);
+            if (ni == ci->second.end())
+                continue;
+            verdict v = compare (mi->first, mi->second, ni->second, threshold / 100);
+            compared++;
+            regressions += v.regressed;
+            improvements += v.improved;
+            if (!all && !v.regressed && !v.improved)
+                continue;
+            if (!header) {
+                printf ("%s\n", gi->first.c_str());
+                header = true;
+            }
+            double ma, mb, var;
+            moments (mi->second, &ma, &var);
+            moments (ni->second, &mb, &var);
+            char interval[64] = "     (1 trial)";
+            if (v.lo <= v.hi)
+                snprintf (interval, sizeof (interval), "[%+7.1f%%, %+7.1f%%]", 100 * v.lo, 100 * v.hi);
+            printf ("  %-18s %12.3f -> %12.3f  %+7.1f%%  %s  n=%zu/%zu%s\n", mi->first.c_str(), ma, mb,
+                    100 * v.delta, interval, mi->second.size(), ni->second.size(),
+                    v.regressed ? "  REGRESSION" : v.improved ? "  improved" : "");
+        }
+    }
+    for (map<string, samples>::iterator ci = cand.begin(); ci != cand.end(); ci++)
+        if (!base.count (ci->first))
+            printf ("%s: new in candidate\n", ci->first.c_str());
+    printf ("%d metrics compared, %d regressions, %d improvements (threshold %.1f%%)\n",
+            compared, regressions, improvements, threshold);
+    return regressions ? 1 : 0;
+}
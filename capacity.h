@@ -0,0 +1,300 @@
+//
+// File:   capacity.h
+//
+// Capacity planning: what would it take to watch these roots? A dry run walks the trees
+// with a pool of scanner threads, watches nothing in them, and reports:
+//
+//    directories       how many watches the roots need, on top of those the user's processes
+//                      hold already (counted in /proc/*/fdinfo), against max_user_watches
+//    kernel memory     per inotify.txt: 540 bytes per watch on 32-bit, 1 kB on 64-bit
+//    user memory       what Watch and the bootstrap walker hold per directory (measured)
+//    bootstrap time    listing time per directory (measured by the scan) plus the cost of
+//                      one inotify_add_watch, times the directories. The add_watch is timed on
+//                      a scratch directory the dry run creates, and removes, in $TMPDIR or /tmp:
+//                      nothing in the roots is ever watched.
+//    big subtrees      the subtrees, and directory names, that would save most if excluded
+//
+//    CapacityPlan plan;
+//    plan.scan (roots, 8);
+//    plan.report (stdout);
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+
+#include "watch.h"
+#include "inotify-instances.h"
+
+// Kernel memory per watch, from inotify.txt.
+#define CAPACITY_KERNEL_BYTES_PER_WATCH (sizeof (void *) == 8 ? 1024 : 540)
+
+class CapacityPlan {
+    struct dir {
+        int parent;             // index, -1 for a root
+        int depth;
+        std::string name;       // full path for roots
+        long size;              // directories in the subtree, itself included
+    };
+    std::vector<dir> dirs;
+    std::deque<int> queue;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    int busy;                   // threads listing a directory right now
+    uint64_t list_ns;           // summed over threads
+    uint64_t wall_ns;
+    size_t name_bytes;
+    long unreadable;
+    int threads;
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    std::string path (int n) const {
+        return dirs[n].parent < 0 ? dirs[n].name : path (dirs[n].parent) + "/" + dirs[n].name;
+    }
+
+    static void *worker (void *arg) {
+        ((CapacityPlan *) arg)->work();
+        return NULL;
+    }
+    void work() {
+        pthread_mutex_lock (&lock);
+        for (;;) {
+            while (queue.empty() && busy > 0)
+                pthread_cond_wait (&more, &lock);
+            if (queue.empty())
+                break;
+            int n = queue.front();
+            queue.pop_front();
+            busy++;
+            std::string p = path (n);
+            int depth = dirs[n].depth;
+            pthread_mutex_unlock (&lock);
+
+            uint64_t t0 = now();
+            std::vector<std::string> found;
+            bool readable = list (p, found);
+            uint64_t t = now() - t0;
+
+            pthread_mutex_lock (&lock);
+            list_ns += t;
+            if (!readable)
+                unreadable++;
+            for (size_t i = 0; i < found.size(); i++) {
+                dir d = {n, depth + 1, found[i], 1};
+                dirs.push_back (d);
+                queue.push_back (dirs.size() - 1);
+                name_bytes += found[i].size();
+            }
+            busy--;
+            pthread_cond_broadcast (&more);
+        }
+        pthread_mutex_unlock (&lock);
+    }
+    // Subdirectories of path, as the bootstrap walker would find them.
+    static bool list (const std::string &path, std::vector<std::string> &found) {
+        DIR *d = opendir (path.c_str());
+        if (!d)
+            return false;
+        while (struct dirent *de = readdir (d)) {
+            if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+                continue;
+            if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+                continue;
+            struct stat st;
+            if (de->d_type == DT_UNKNOWN &&
+                (lstat ((path + "/" + de->d_name).c_str(), &st) < 0 || !S_ISDIR (st.st_mode)))
+                continue;
+            found.push_back (de->d_name);
+        }
+        closedir (d);
+        return true;
+    }
+
+    // Cost of one inotify_add_watch, timed in a scratch instance on sample directories of a
+    // scratch tree made for it, so that the dry run never watches the roots.
+    static double add_watch_ns (int sample) {
+        const char *tmp = getenv ("TMPDIR");
+        std::string base = std::string (tmp && *tmp ? tmp : "/tmp") + "/capacity.XXXXXX";
+        std::vector<char> tmpl (base.begin(), base.end());
+        tmpl.push_back ('\0');
+        if (!mkdtemp (&tmpl[0]))
+            return 0;
+        base = &tmpl[0];
+        int fd = inotify_init1 (IN_NONBLOCK), n = 0;
+        uint64_t t = 0;
+        for (int i = 0; i < sample && fd >= 0; i++) {
+            char name[32];
+            snprintf (name, sizeof (name), "/d%d", i);
+            std::string p = base + name;
+            if (mkdir (p.c_str(), 0700) < 0)
+                break;
+            uint64_t t0 = now();
+            int wd = inotify_add_watch (fd, p.c_str(), IN_CREATE | IN_DELETE);
+            t += now() - t0;
+            if (wd >= 0)
+                n++;
+        }
+        if (fd >= 0)
+            close (fd);
+        for (int i = 0; i < sample; i++) {
+            char name[32];
+            snprintf (name, sizeof (name), "/d%d", i);
+            rmdir ((base + name).c_str());
+        }
+        rmdir (base.c_str());
+        return n ? (double) t / n : 0;
+    }
+    static long max_user_watches() {
+        long n = -1;
+        FILE *f = fopen ("/proc/sys/fs/inotify/max_user_watches", "r");
+        if (f) {
+            if (fscanf (f, "%ld", &n) != 1)
+                n = -1;
+            fclose (f);
+        }
+        return n;
+    }
+    // User memory per watched directory: measured on a Watch holding a few thousand entries
+    // with the tree's average name length, plus the walker's node for it.
+    double user_bytes_per_dir() const {
+        size_t avg = dirs.size() ? name_bytes / dirs.size() : 8;
+        Watch w;
+        const int n = 4096;
+        std::string name (avg, 'x');
+        for (int i = 1; i <= n; i++)
+            w.insert (i == 1 ? -1 : i / 2, name, i);
+        return (double) w.usage() / n + 160 + avg;
+    }
+
+public:
+    CapacityPlan() : busy (0), list_ns (0), wall_ns (0), name_bytes (0), unreadable (0), threads (1) {
+        pthread_mutex_init (&lock, NULL);
+        pthread_cond_init (&more, NULL);
+    }
+    ~CapacityPlan() {
+        pthread_mutex_destroy (&lock);
+        pthread_cond_destroy (&more);
+    }
+
+    // Walk the roots with nthreads scanners. Returns the number of directories found.
+    size_t scan (const std::vector<std::string> &roots, int nthreads) {
+        threads = nthreads > 0 ? nthreads : 1;
+        uint64_t t0 = now();
+        for (size_t i = 0; i < roots.size(); i++) {
+            dir d = {-1, 0, roots[i], 1};
+            dirs.push_back (d);
+            queue.push_back (dirs.size() - 1);
+        }
+        std::vector<pthread_t> tids (threads);
+        for (int i = 0; i < threads; i++)
+            pthread_create (&tids[i], NULL, worker, this);
+        for (int i = 0; i < threads; i++)
+            pthread_join (tids[i], NULL);
+        wall_ns = now() - t0;
+        // Children always come after their parent, so one backward pass sums the subtrees.
+        for (size_t i = dirs.size(); i-- > 0; )
+            if (dirs[i].parent >= 0)
+                dirs[dirs[i].parent].size += dirs[i].size;
+        return dirs.size();
+    }
+
+    void report (FILE *out, int top = 10) const {
+        long n = dirs.size(), limit = max_user_watches(), used;
+        int instances = user_instances (&used);
+        double watch_ns = add_watch_ns (100);
+        // More threads than CPUs stretch each listing with waiting; the wall clock caps that.
+        long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        double per_dir_ns = n ? std::min ((double) list_ns, (double) wall_ns * std::min ((long) threads, cpus)) / n : 0;
+        double user = user_bytes_per_dir() * n;
+        fprintf (out, "directories:     %ld (scanned in %.1f ms with %d threads, %ld unreadable)\n",
+                 n, wall_ns / 1e6, threads, unreadable);
+        if (limit > 0)
+            fprintf (out, "watches:         %ld + %ld in use of max_user_watches %ld (%.1f%%)%s\n", n, used,
+                     limit, 100.0 * (n + used) / limit, n + used > limit ? "  ** over the limit **" : "");
+        else
+            fprintf (out, "watches:         %ld + %ld in use (max_user_watches unknown)\n", n, used);
+        fprintf (out, "instances:       max_user_instances %d, %d in use\n", max_user_instances(), instances);
+        fprintf (out, "kernel memory:   %.1f MB (%d bytes per watch)\n",
+                 n * (double) CAPACITY_KERNEL_BYTES_PER_WATCH / 1048576, (int) CAPACITY_KERNEL_BYTES_PER_WATCH);
+        fprintf (out, "user memory:     %.1f MB (%.0f bytes per directory)\n", user / 1048576, n ? user / n : 0);
+        fprintf (out, "bootstrap time:  %.1f s (%.1f us listing + %.1f us add_watch per directory, one thread)\n",
+                 n * (per_dir_ns + watch_ns) / 1e9, per_dir_ns / 1000, watch_ns / 1000);
+
+        // Largest subtrees below the roots, none inside another.
+        std::vector<int> order;
+        for (size_t i = 0; i < dirs.size(); i++)
+            if (dirs[i].parent >= 0)
+                order.push_back (i);
+        std::sort (order.begin(), order.end(), by_size (dirs));
+        std::vector<int> picked;
+        for (size_t i = 0; i < order.size() && (int) picked.size() < top; i++) {
+            bool inside = false;
+            for (int a = dirs[order[i]].parent; a >= 0 && !inside; a = dirs[a].parent)
+                inside = std::find (picked.begin(), picked.end(), a) != picked.end();
+            if (!inside)
+                picked.push_back (order[i]);
+        }
+        if (!picked.empty())
+            fprintf (out, "largest subtrees (excluding one saves its watches):\n");
+        for (size_t i = 0; i < picked.size(); i++)
+            fprintf (out, "  %8ld  %5.1f%%  %s\n", dirs[picked[i]].size, 100.0 * dirs[picked[i]].size / n,
+                     path (picked[i]).c_str());
+
+        // Names whose subtrees, wherever they occur, add up the most (node_modules, .git, ...).
+        // Only the outermost occurrence counts, nested ones are inside it already.
+        std::map<std::string, std::pair<long, long> > names;     // name -> (subtrees, dirs)
+        for (size_t i = 0; i < dirs.size(); i++) {
+            if (dirs[i].parent < 0)
+                continue;
+            bool nested = false;
+            for (int a = dirs[i].parent; a >= 0 && !nested; a = dirs[a].parent)
+                nested = dirs[a].parent >= 0 && dirs[a].name == dirs[i].name;
+            if (nested)
+                continue;
+            std::pair<long, long> &e = names[dirs[i].name];
+            e.first++;
+            e.second += dirs[i].size;
+        }
+        std::vector<std::pair<long, std::string> > ranked;
+        for (std::map<std::string, std::pair<long, long> >::iterator ni = names.begin(); ni != names.end(); ni++)
+            if (ni->second.first > 1)
+                ranked.push_back (std::make_pair (ni->second.second, ni->first));
+        std::sort (ranked.rbegin(), ranked.rend());
+        if (!ranked.empty())
+            fprintf (out, "largest recurring names (excluding by name):\n");
+        for (size_t i = 0; i < ranked.size() && (int) i < top; i++)
+            fprintf (out, "  %8ld  %5.1f%%  %s (%ld subtrees)\n", ranked[i].first, 100.0 * ranked[i].first / n,
+                     ranked[i].second.c_str(), names[ranked[i].second].first);
+    }
+
+private:
+    struct by_size {
+        const std::vector<dir> &d;
+        by_size (const std::vector<dir> &d) : d (d) {}
+        bool operator() (int a, int b) const { return d[a].size > d[b].size; }
+    };
+};
+
+#endif
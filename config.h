@@ -0,0 +1,231 @@
+//
+// File:   config.h
+//
+// Configuration file, and reloading it into a running Watcher without starting over. The
+// format is one directive per line, # to the end of a line is a comment:
+//
+//    mask create delete              # default events for the roots below (names as in
+//                                    # IN_*, lower case; "all" for IN_ALL_EVENTS)
+//    root ./tmp                      # watch ./tmp with the default mask
+//    root /srv/www create modify     # ... or with its own
+//    exclude *.swp                   # don't deliver events for names matching (fnmatch)
+//
+// ConfigReloader::reload() reads the file again and applies only what changed: roots no
+// longer listed are removed with everything below them, new ones added and walked, roots
+// whose mask changed get the new mask on each of their watches (the kernel keeps the watch
+// and its wd, and Watch, the walker and the sink's state stay as they are), and the exclude
+// patterns are replaced. Roots that didn't change aren't touched at all. A file that doesn't
+// parse changes nothing, and a root that can't be watched is left out, to be tried again on
+// the next reload.
+//
+// The kernel is always asked for the watcher's own flags (watch_flags()) on top of a root's
+// mask, since following new and deleted directories depends on them; PatternFilter then
+// delivers only the events the root's mask asked for.
+//
+//    Watcher<InotifyBackend, Watch, PatternFilter> w;
+//    ConfigReloader<Watcher<InotifyBackend, Watch, PatternFilter> > config (w, "watch.conf");
+//    w.init();
+//    config.reload();            // the first load adds every root
+//    ...
+//    config.reload();            // on SIGHUP
+//
+// Roots are taken as written: one root inside another is not supported.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "watch.h"
+
+struct watch_config {
+    uint32_t mask;                          // default mask
+    std::map<std::string, uint32_t> roots;  // path -> mask
+    std::vector<std::string> exclude;
+};
+
+static inline bool config_mask (const char *name, uint32_t *mask)
+{
+    static const struct { const char *name; uint32_t mask; } names[] = {
+        {"access", IN_ACCESS}, {"modify", IN_MODIFY}, {"attrib", IN_ATTRIB},
+        {"close_write", IN_CLOSE_WRITE}, {"close_nowrite", IN_CLOSE_NOWRITE}, {"open", IN_OPEN},
+        {"moved_from", IN_MOVED_FROM}, {"moved_to", IN_MOVED_TO}, {"create", IN_CREATE},
+        {"delete", IN_DELETE}, {"delete_self", IN_DELETE_SELF}, {"move_self", IN_MOVE_SELF},
+        {"close", IN_CLOSE}, {"move", IN_MOVE}, {"all", IN_ALL_EVENTS},
+    };
+    for (size_t i = 0; i < sizeof (names) / sizeof (names[0]); i++)
+        if (!strcmp (name, names[i].name)) {
+            *mask |= names[i].mask;
+            return true;
+        }
+    return false;
+}
+
+// Parse file into out. On error, prints where and returns false.
+static inline bool config_load (const char *file, watch_config &out)
+{
+    FILE *f = fopen (file, "r");
+    if (!f) {
+        perror (file);
+        return false;
+    }
+    watch_config c;
+    c.mask = IN_CREATE | IN_DELETE;
+    char line[4096];
+    bool ok = true;
+    for (int n = 1; ok && fgets (line, sizeof (line), f); n++) {
+        if (char *hash = strchr (line, '#'))
+            *hash = '\0';
+        std::vector<char *> words;
+        for (char *w = strtok (line, " \t\r\n"); w; w = strtok (NULL, " \t\r\n"))
+            words.push_back (w);
+        if (words.empty())
+            continue;
+        std::string what = words[0];
+        uint32_t mask = 0;
+        size_t first_mask = what == "mask" ? 1 : 2;
+        for (size_t i = first_mask; ok && i < words.size() && what != "exclude"; i++)
+            if (!config_mask (words[i], &mask)) {
+                fprintf (stderr, "%s:%d: unknown event %s\n", file, n, words[i]);
+                ok = false;
+            }
+        if (!ok)
+            break;
+        if (what == "mask" && mask) {
+            c.mask = mask;
+        } else if (what == "root" && words.size() >= 2) {
+            std::string path = words[1];
+            while (path.size() > 1 && path[path.size() - 1] == '/')
+                path.erase (path.size() - 1);
+            c.roots[path] = mask ? mask : c.mask;
+        } else if (what == "exclude" && words.size() == 2) {
+            c.exclude.push_back (words[1]);
+        } else {
+            fprintf (stderr, "%s:%d: cannot parse '%s'\n", file, n, what.c_str());
+            ok = false;
+        }
+    }
+    fclose (f);
+    if (ok)
+        out = c;
+    return ok;
+}
+
+// Filter policy: everything but names matching an exclude pattern, and, for roots given a
+// mask, events it doesn't ask for.
+struct PatternFilter {
+    std::vector<std::string> exclude;
+    std::map<int, uint32_t> masks;          // root wd -> events delivered from below it
+    const Watch *tree;                      // to find an event's root
+    PatternFilter() : tree (NULL) {}
+
+    bool accept (const struct inotify_event *event) const {
+        if (!masks.empty() && tree) {
+            int root = event->wd;
+            for (int pd = tree->parent (root); pd != -1; pd = tree->parent (root))
+                root = pd;
+            std::map<int, uint32_t>::const_iterator mi = masks.find (root);
+            if (mi != masks.end() && !(mi->second & event->mask & IN_ALL_EVENTS))
+                return false;
+        }
+        for (size_t i = 0; i < exclude.size(); i++)
+            if (fnmatch (exclude[i].c_str(), event->name, 0) == 0)
+                return false;
+        return true;
+    }
+};
+
+// Applies a configuration file to a Watcher whose filter is a PatternFilter, and reapplies
+// it when it changes.
+template <class W>
+class ConfigReloader {
+    W &w;
+    std::string file;
+    watch_config current;
+    unsigned long reloads;
+
+    // Deliver mask from root and below, and have the kernel report it, plus what the watcher
+    // needs, on every watch there. Returns the number of watches changed.
+    size_t remask (int root, uint32_t mask) {
+        w.filter().masks[root] = mask;
+        std::vector<int> wds;
+        w.storage().subtree (root, wds);
+        size_t changed = 0;
+        for (size_t i = 0; i < wds.size(); i++) {
+            if (w.mask (wds[i]) != (mask | w.watch_flags())) {
+                w.set_mask (wds[i], mask | w.watch_flags());
+                changed++;
+            }
+        }
+        return changed;
+    }
+public:
+    ConfigReloader (W &w, const char *file) : w (w), file (file), reloads (0) {
+        current.mask = 0;
+        w.filter().tree = &w.storage();
+    }
+    const watch_config &config() const { return current; }
+
+    // Read the file and apply the differences to the running watcher. Returns false, having
+    // changed nothing, if the file can't be read or parsed.
+    bool reload() {
+        watch_config next;
+        if (!config_load (file.c_str(), next))
+            return false;
+        int added = 0, removed = 0, remasked = 0;
+        size_t unwatched = 0, touched = 0;
+        std::vector<std::string> failed;
+        std::map<std::string, uint32_t>::iterator oi = current.roots.begin(), ni = next.roots.begin();
+        while (oi != current.roots.end() || ni != next.roots.end()) {
+            if (ni == next.roots.end() || (oi != current.roots.end() && oi->first < ni->first)) {
+                w.filter().masks.erase (w.root (oi->first.c_str()));
+                int n = w.remove_root (oi->first.c_str());
+                if (n >= 0) {
+                    unwatched += n;
+                    removed++;
+                }
+                oi++;
+            } else if (oi == current.roots.end() || ni->first < oi->first) {
+                int wd = w.add_root (ni->first.c_str());
+                if (wd >= 0) {
+                    remask (wd, ni->second);
+                    added++;
+                } else {
+                    w.remove_root (ni->first.c_str());
+                    failed.push_back (ni->first);
+                }
+                ni++;
+            } else {
+                if (oi->second != ni->second) {
+                    touched += remask (w.root (ni->first.c_str()), ni->second);
+                    remasked++;
+                }
+                oi++;
+                ni++;
+            }
+        }
+        bool filter = w.filter().exclude != next.exclude;
+        if (filter)
+            w.filter().exclude = next.exclude;
+        for (size_t i = 0; i < failed.size(); i++)
+            next.roots.erase (failed[i]);
+        current = next;
+        if (reloads++)
+            printf ("config %s: %d roots added, %d removed (%zu watches), %d with a new mask (%zu watches)%s%s\n",
+                    file.c_str(), added, removed, unwatched, remasked, touched,
+                    filter ? ", exclude patterns replaced" : "", failed.empty() ? "" : ", some roots failed");
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,240 @@
+//
+// File:   dirtymap.h
+//
+// Dirty-directory bitmap in shared memory, for consumers that only need to know which
+// directories changed, not every event. Each watched directory gets a dense id (wds only ever
+// grow, ids are reused), and an event sets the directory's bit with one atomic OR. Consumers
+// in other processes map the same segment and collect changed directories by atomically
+// swapping each non-zero word with 0, so a poll costs O(bitmap words) however many events
+// happened, and nothing is lost between swap and clear.
+//
+// Segment layout (all little endian, naturally aligned):
+//
+//    header   magic, version, capacity (ids), generation
+//    words    capacity / 64 x uint64_t, bit id set = directory id changed
+//    wds      capacity x int32_t, the wd currently owning each id (-1: free)
+//
+// Id 0 is reserved: it is set on queue overflow or when ids run out, and means "something
+// changed that can't be pinned down, rescan everything".
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef DIRTYMAP_H
+#define DIRTYMAP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "watch.h"
+
+#define DIRTYMAP_MAGIC      0x64697274      // "dirt"
+#define DIRTYMAP_VERSION    1
+#define DIRTYMAP_OVERFLOW   0
+
+struct dirtymap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t generation;    // bumped whenever an id changes owner
+};
+
+// Maps a segment created by DirtyMap. Base of both the writer and the reader.
+class DirtySegment {
+protected:
+    void *base;
+    size_t size;
+    dirtymap_header *header;
+    uint64_t *words;
+    int32_t *wds;
+
+    static size_t bytes (uint32_t capacity) {
+        return sizeof (dirtymap_header) + capacity / 8 + capacity * sizeof (int32_t);
+    }
+    bool map (int fd, bool writable) {
+        int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+        base = mmap (NULL, size, prot, MAP_SHARED, fd, 0);
+        close (fd);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            return false;
+        }
+        header = (dirtymap_header *) base;
+        words = (uint64_t *) (header + 1);
+        wds = (int32_t *) (words + header->capacity / 64);
+        return true;
+    }
+public:
+    DirtySegment() : base (NULL), size (0), header (NULL), words (NULL), wds (NULL) {}
+    ~DirtySegment() {
+        if (base)
+            munmap (base, size);
+    }
+    uint32_t capacity() const { return header ? header->capacity : 0; }
+};
+
+// Writer side, owned by the watcher.
+class DirtyMap : public DirtySegment {
+    std::string name;
+    std::vector<uint32_t> ids;      // wd -> id, 0 if none
+    std::vector<uint32_t> free_ids;
+    uint32_t next_id;
+public:
+    DirtyMap() : next_id (1) {}
+    ~DirtyMap() {
+        if (!name.empty())
+            shm_unlink (name.c_str());
+    }
+
+    // Create (or replace) the shared memory segment /name for up to capacity directories,
+    // rounded up to a multiple of 64.
+    bool create (const char *shm_name, uint32_t capacity) {
+        capacity = (capacity + 63) & ~63u;
+        int fd = shm_open (shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        size = bytes (capacity);
+        if (ftruncate (fd, size) < 0) {
+            close (fd);
+            return false;
+        }
+        name = shm_name;
+        // The header is written before mapping the rest, so map() knows the capacity.
+        dirtymap_header h = {DIRTYMAP_MAGIC, DIRTYMAP_VERSION, capacity, 0};
+        if (pwrite (fd, &h, sizeof (h), 0) != (ssize_t) sizeof (h)) {
+            close (fd);
+            return false;
+        }
+        if (!map (fd, true))
+            return false;
+        memset (wds, 0xff, capacity * sizeof (int32_t));
+        return true;
+    }
+
+    // Dense id of wd, allocated on first use. Returns DIRTYMAP_OVERFLOW if none are left.
+    uint32_t id (int wd) {
+        if (wd < 0)
+            return DIRTYMAP_OVERFLOW;
+        if ((size_t) wd < ids.size() && ids[wd])
+            return ids[wd];
+        uint32_t id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else if (next_id < header->capacity) {
+            id = next_id++;
+        } else {
+            return DIRTYMAP_OVERFLOW;
+        }
+        if ((size_t) wd >= ids.size())
+            ids.resize (wd + 1024);
+        ids[wd] = id;
+        __atomic_store_n (&wds[id], wd, __ATOMIC_RELEASE);
+        __atomic_fetch_add (&header->generation, 1, __ATOMIC_RELEASE);
+        return id;
+    }
+    bool has (int wd) const { return wd >= 0 && (size_t) wd < ids.size() && ids[wd]; }
+    // The directory is gone: its id may go to another directory.
+    void release (int wd) {
+        if (wd < 0 || (size_t) wd >= ids.size() || !ids[wd])
+            return;
+        __atomic_store_n (&wds[ids[wd]], -1, __ATOMIC_RELEASE);
+        __atomic_fetch_add (&header->generation, 1, __ATOMIC_RELEASE);
+        free_ids.push_back (ids[wd]);
+        ids[wd] = 0;
+    }
+
+    // Mark wd's directory as changed: one atomic OR, skipped when the bit is already set (a
+    // consumer that clears it after our check still reports the directory).
+    void mark (int wd) {
+        uint32_t i = wd >= 0 && (size_t) wd < ids.size() && ids[wd] ? ids[wd] : id (wd);
+        uint64_t bit = 1ULL << (i & 63);
+        if (!(__atomic_load_n (&words[i >> 6], __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or (&words[i >> 6], bit, __ATOMIC_RELEASE);
+    }
+};
+
+// Reader side, in any process.
+class DirtyReader : public DirtySegment {
+public:
+    bool open (const char *shm_name) {
+        int fd = shm_open (shm_name, O_RDWR, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        dirtymap_header h;
+        if (fstat (fd, &st) < 0 || pread (fd, &h, sizeof (h), 0) != (ssize_t) sizeof (h) ||
+            h.magic != DIRTYMAP_MAGIC || h.version != DIRTYMAP_VERSION ||
+            (size_t) st.st_size < bytes (h.capacity)) {
+            close (fd);
+            errno = EINVAL;
+            return false;
+        }
+        size = bytes (h.capacity);
+        return map (fd, true);
+    }
+
+    // Swap out and clear every changed word, appending the wds of changed directories. Returns
+    // true if the overflow bit was set, meaning everything should be rescanned.
+    bool collect (std::vector<int> &changed) {
+        bool overflow = false;
+        uint32_t n = header->capacity / 64;
+        for (uint32_t w = 0; w < n; w++) {
+            if (!__atomic_load_n (&words[w], __ATOMIC_RELAXED))
+                continue;
+            uint64_t bits = __atomic_exchange_n (&words[w], 0, __ATOMIC_ACQ_REL);
+            while (bits) {
+                uint32_t id = w * 64 + __builtin_ctzll (bits);
+                bits &= bits - 1;
+                if (id == DIRTYMAP_OVERFLOW) {
+                    overflow = true;
+                    continue;
+                }
+                int wd = __atomic_load_n (&wds[id], __ATOMIC_ACQUIRE);
+                if (wd >= 0)
+                    changed.push_back (wd);
+            }
+        }
+        return overflow;
+    }
+    uint32_t generation() const { return __atomic_load_n (&header->generation, __ATOMIC_ACQUIRE); }
+};
+
+// Sink policy for Watcher: marks the directory every event happened in. With storage set
+// (w.sink().storage = &w.storage()), the ids of deleted directories are given back: a
+// directory's (parent wd, name) is noted when it gets its id, and its IN_DELETE in the parent
+// releases the id. Without it, ids are never reused.
+struct DirtySink {
+    DirtyMap map;
+    Watch *storage;
+    std::map<std::pair<int, std::string>, int> named;   // (parent wd, name) -> wd holding an id
+    DirtySink() : storage (NULL) {}
+
+    void event (const std::string &, const struct inotify_event *event) {
+        if (storage && !map.has (event->wd) && storage->has (event->wd))
+            named[std::make_pair (storage->parent (event->wd), storage->name (event->wd))] = event->wd;
+        map.mark (event->wd);
+        if ((event->mask & (IN_DELETE | IN_ISDIR)) == (IN_DELETE | IN_ISDIR) && !named.empty()) {
+            std::map<std::pair<int, std::string>, int>::iterator ni = named.find (std::make_pair (event->wd, std::string (event->name)));
+            if (ni != named.end()) {
+                map.release (ni->second);
+                named.erase (ni);
+            }
+        }
+    }
+    void overflow() { map.mark (-1); }
+    void ready (const std::string &, int, int, int) {}
+    void stats() {}
+};
+
+#endif
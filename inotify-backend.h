@@ -0,0 +1,555 @@
+//
+// File:   inotify-backend.h
+//
+// Event sources for inotify-example.cpp. Every backend offers the same few calls as the
+// inotify API itself (add_watch, rm_watch, read), plus wait(), which blocks like select and
+// returns 0 on timeout or once a backend has nothing more to deliver. The event loop is
+// written once against that shape and can be pointed at the kernel or at a scripted fake.
+//
+// Two more backends speak the same inotify wire format from other sources, so the same
+// pipeline can be compared across mechanisms (see inotify-bench.cpp): FanotifyBackend
+// (fanotify with directory file handles, Linux 5.9+, needs CAP_SYS_ADMIN) and PollingBackend,
+// which rescans watched directories and reports the differences.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef INOTIFY_BACKEND_H
+#define INOTIFY_BACKEND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/fanotify.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <map>
+#include <deque>
+
+#include "snapdiff.h"
+
+// Append one event in the kernel's format (name NUL padded to a multiple of the header size)
+// at buffer + used, if it fits in len. Returns the new used, or used unchanged if it didn't fit.
+inline size_t pack_event (char *buffer, size_t used, size_t len, int wd, uint32_t mask,
+                          uint32_t cookie, const char *name)
+{
+    size_t name_size = name ? strlen (name) : 0;
+    size_t name_len = name_size ? (name_size + sizeof (struct inotify_event)) & ~(sizeof (struct inotify_event) - 1) : 0;
+    size_t size = sizeof (struct inotify_event) + name_len;
+    if (used + size > len)
+        return used;
+    struct inotify_event *event = (struct inotify_event *) &buffer[used];
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = cookie;
+    event->len = name_len;
+    memset (event->name, 0, name_len);
+    memcpy (event->name, name, name_size);
+    return used + size;
+}
+
+// The real thing: a thin wrapper around one inotify instance.
+class InotifyBackend {
+    int fd;
+    fd_set watch_set;
+public:
+    InotifyBackend() : fd (-1) {}
+    ~InotifyBackend() { close(); }
+
+    // inotify_init1 not available with older kernels, consequently inotify reads block.
+    int init() {
+#ifdef IN_NONBLOCK
+        fd = inotify_init1 (IN_NONBLOCK);
+#else
+        fd = inotify_init();
+#endif
+        return fd;
+    }
+    int add_watch (const char *path, uint32_t mask) { return inotify_add_watch (fd, path, mask); }
+    int rm_watch (int wd) { return inotify_rm_watch (fd, wd); }
+    // Wait until the inotify fd has 1 or more events, or timeout_ms (-1: forever) passes.
+    // select needs the highest fd (+1).
+    int wait (int timeout_ms = -1) {
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        FD_ZERO (&watch_set);
+        FD_SET (fd, &watch_set);
+        return select (fd+1, &watch_set, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    }
+    ssize_t read (char *buffer, size_t len) { return ::read (fd, buffer, len); }
+    int get_fd() const { return fd; }
+    void close() {
+        if (fd >= 0)
+            ::close (fd);
+        fd = -1;
+    }
+};
+
+// FakeBackend never touches the filesystem. Events are scripted up front (any wd, mask,
+// cookie and name, including IN_Q_OVERFLOW and IN_IGNORED) and handed out by read() in the
+// same wire format the kernel uses, so event handling, overflow recovery and throughput can
+// be exercised deterministically.
+//
+// add_watch behaves like the kernel's: the same path always yields the same wd, new paths
+// get increasing wds starting at 1, and scripted failures (e.g. ENOSPC) are returned in
+// order. rm_watch queues the IN_IGNORED the kernel would send.
+class FakeBackend {
+    struct fake_event {
+        int wd;
+        uint32_t mask;
+        uint32_t cookie;
+        std::string name;
+        int fail_err;       // with fail_count > 0: not an event, arms add_watch failures
+        int fail_count;
+    };
+    std::deque<fake_event> events;
+    std::deque<int> add_errors;
+    std::map<std::string, int> paths;
+    std::map<int, std::string> wds;
+    int next_wd;
+public:
+    FakeBackend() : next_wd (1) {}
+
+    // --- scripting ---
+    void event (int wd, uint32_t mask, uint32_t cookie = 0, const std::string &name = "") {
+        fake_event ev = {wd, mask, cookie, name, 0, 0};
+        events.push_back (ev);
+    }
+    void overflow() { event (-1, IN_Q_OVERFLOW); }
+    void ignored (int wd) { event (wd, IN_IGNORED); }
+    // The next count calls to add_watch made after every event scripted so far has been read
+    // fail with err (0 lets a call through, so failures can be interleaved with successes).
+    void fail_add_watch (int err = ENOSPC, int count = 1) {
+        if (events.empty()) {
+            while (count-- > 0)
+                add_errors.push_back (err);
+        } else if (count > 0) {
+            fake_event ev = {0, 0, 0, "", err, count};
+            events.push_back (ev);
+        }
+    }
+    size_t pending() const { return events.size(); }
+    size_t watches() const { return wds.size(); }
+    // Path a wd was added for, or "" if the wd isn't live.
+    std::string path (int wd) const {
+        std::map<int, std::string>::const_iterator wi = wds.find (wd);
+        return wi == wds.end() ? "" : wi->second;
+    }
+
+    // Load a script, one command per line ('#' starts a comment):
+    //    event <wd> <mask> [cookie] [name]     mask is a number or e.g. IN_CREATE|IN_ISDIR
+    //    overflow
+    //    ignored <wd>
+    //    fail_add_watch [errno] [count]        errno is a number or ENOSPC, ENOENT, ...
+    // Returns the number of commands loaded, or -1 (and prints the line) on a parse error.
+    int load (FILE *in) {
+        char line[PATH_MAX + 128];
+        int n = 0;
+        for (int lineno = 1; fgets (line, sizeof (line), in); lineno++) {
+            char *hash = strchr (line, '#');
+            if (hash)
+                *hash = '\0';
+            char cmd[32], arg1[64], arg2[64], arg3[32], name[NAME_MAX + 1];
+            int fields = sscanf (line, "%31s %63s %63s %31s %255s", cmd, arg1, arg2, arg3, name);
+            if (fields <= 0)
+                continue;
+            if (!strcmp (cmd, "event") && fields >= 3) {
+                event (atoi (arg1), parse_mask (arg2), fields >= 4 ? strtoul (arg3, NULL, 0) : 0,
+                       fields >= 5 ? name : "");
+            } else if (!strcmp (cmd, "overflow")) {
+                overflow();
+            } else if (!strcmp (cmd, "ignored") && fields >= 2) {
+                ignored (atoi (arg1));
+            } else if (!strcmp (cmd, "fail_add_watch")) {
+                fail_add_watch (fields >= 2 ? parse_errno (arg1) : ENOSPC, fields >= 3 ? atoi (arg2) : 1);
+            } else {
+                fprintf (stderr, "script line %d not understood: %s", lineno, line);
+                return -1;
+            }
+            n++;
+        }
+        return n;
+    }
+
+    // --- backend calls ---
+    int init() { return 0; }
+    int add_watch (const char *path, uint32_t /* mask */) {
+        if (!add_errors.empty()) {
+            int err = add_errors.front();
+            add_errors.pop_front();
+            if (err) {
+                errno = err;
+                return -1;
+            }
+        }
+        std::map<std::string, int>::iterator pi = paths.find (path);
+        if (pi != paths.end())
+            return pi->second;
+        int wd = next_wd++;
+        paths[path] = wd;
+        wds[wd] = path;
+        return wd;
+    }
+    int rm_watch (int wd) {
+        std::map<int, std::string>::iterator wi = wds.find (wd);
+        if (wi == wds.end()) {
+            errno = EINVAL;
+            return -1;
+        }
+        paths.erase (wi->second);
+        wds.erase (wi);
+        ignored (wd);
+        return 0;
+    }
+    // 0 means the script is exhausted.
+    int wait (int /* timeout_ms */ = -1) { return events.empty() ? 0 : 1; }
+    // Pack as many events as fit. Like the kernel, names are NUL padded to a multiple of the
+    // event header size, an empty queue gives EAGAIN and a buffer too small for the next
+    // event gives EINVAL.
+    ssize_t read (char *buffer, size_t len) {
+        if (events.empty()) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t used = 0;
+        while (!events.empty()) {
+            const fake_event &ev = events.front();
+            // A failure armed mid-script ends the batch, so it only hits add_watch calls made
+            // while handling the events that follow it.
+            if (ev.fail_count > 0) {
+                if (used)
+                    break;
+                add_errors.insert (add_errors.end(), ev.fail_count, ev.fail_err);
+                events.pop_front();
+                continue;
+            }
+            size_t next = pack_event (buffer, used, len, ev.wd, ev.mask, ev.cookie, ev.name.c_str());
+            if (next == used)
+                break;
+            used = next;
+            events.pop_front();
+        }
+        if (!used) {
+            errno = events.empty() ? EAGAIN : EINVAL;
+            return -1;
+        }
+        return used;
+    }
+    int get_fd() const { return -1; }
+    void close() {}
+
+private:
+    static uint32_t parse_mask (const char *s) {
+        static const struct { const char *name; uint32_t bit; } bits[] = {
+            {"IN_ACCESS", IN_ACCESS}, {"IN_MODIFY", IN_MODIFY}, {"IN_ATTRIB", IN_ATTRIB},
+            {"IN_CLOSE_WRITE", IN_CLOSE_WRITE}, {"IN_CLOSE_NOWRITE", IN_CLOSE_NOWRITE},
+            {"IN_OPEN", IN_OPEN}, {"IN_MOVED_FROM", IN_MOVED_FROM}, {"IN_MOVED_TO", IN_MOVED_TO},
+            {"IN_CREATE", IN_CREATE}, {"IN_DELETE", IN_DELETE}, {"IN_DELETE_SELF", IN_DELETE_SELF},
+            {"IN_MOVE_SELF", IN_MOVE_SELF}, {"IN_UNMOUNT", IN_UNMOUNT},
+            {"IN_Q_OVERFLOW", IN_Q_OVERFLOW}, {"IN_IGNORED", IN_IGNORED}, {"IN_ISDIR", IN_ISDIR},
+        };
+        uint32_t mask = 0;
+        std::string all (s);
+        for (size_t start = 0; start <= all.size(); ) {
+            size_t end = all.find ('|', start);
+            if (end == std::string::npos)
+                end = all.size();
+            std::string part = all.substr (start, end - start);
+            bool found = false;
+            for (size_t i = 0; i < sizeof (bits) / sizeof (bits[0]); i++) {
+                if (part == bits[i].name) {
+                    mask |= bits[i].bit;
+                    found = true;
+                }
+            }
+            if (!found)
+                mask |= strtoul (part.c_str(), NULL, 0);
+            start = end + 1;
+        }
+        return mask;
+    }
+    static int parse_errno (const char *s) {
+        static const struct { const char *name; int err; } errs[] = {
+            {"ENOSPC", ENOSPC}, {"ENOENT", ENOENT}, {"EACCES", EACCES}, {"ENOMEM", ENOMEM},
+            {"ENOTDIR", ENOTDIR}, {"EINVAL", EINVAL}, {"OK", 0},
+        };
+        for (size_t i = 0; i < sizeof (errs) / sizeof (errs[0]); i++)
+            if (!strcmp (s, errs[i].name))
+                return errs[i].err;
+        return atoi (s);
+    }
+};
+
+#ifdef FAN_REPORT_DFID_NAME
+// fanotify translated to inotify events. Directory entry events (create, delete, move) are
+// marked on the directory itself, per-file events (modify, attrib, close_write) with
+// FAN_EVENT_ON_CHILD; the kernel refuses the two kinds in one mark. Events identify their
+// directory by file handle, which add_watch maps to a wd of our own.
+class FanotifyBackend {
+    int fd;
+    int next_wd;
+    std::map<std::string, int> handles;     // fsid + file handle -> wd
+    std::map<int, std::string> paths;       // wd -> path
+    std::map<int, uint32_t> masks;          // wd -> inotify mask
+    fd_set watch_set;
+    char raw[64 * 1024];
+
+    static uint64_t dirent_bits (uint32_t in_mask) {
+        uint64_t m = 0;
+        if (in_mask & IN_CREATE) m |= FAN_CREATE;
+        if (in_mask & IN_DELETE) m |= FAN_DELETE;
+        if (in_mask & IN_MOVED_FROM) m |= FAN_MOVED_FROM;
+        if (in_mask & IN_MOVED_TO) m |= FAN_MOVED_TO;
+        if (in_mask & IN_DELETE_SELF) m |= FAN_DELETE_SELF;
+        return m ? m | FAN_ONDIR : 0;
+    }
+    static uint64_t child_bits (uint32_t in_mask) {
+        uint64_t m = 0;
+        if (in_mask & IN_MODIFY) m |= FAN_MODIFY;
+        if (in_mask & IN_ATTRIB) m |= FAN_ATTRIB;
+        if (in_mask & IN_CLOSE_WRITE) m |= FAN_CLOSE_WRITE;
+        return m ? m | FAN_EVENT_ON_CHILD : 0;
+    }
+    static uint32_t in_bits (uint64_t fan_mask) {
+        uint32_t m = 0;
+        if (fan_mask & FAN_CREATE) m |= IN_CREATE;
+        if (fan_mask & FAN_DELETE) m |= IN_DELETE;
+        if (fan_mask & FAN_MOVED_FROM) m |= IN_MOVED_FROM;
+        if (fan_mask & FAN_MOVED_TO) m |= IN_MOVED_TO;
+        if (fan_mask & FAN_DELETE_SELF) m |= IN_DELETE_SELF;
+        if (fan_mask & FAN_MODIFY) m |= IN_MODIFY;
+        if (fan_mask & FAN_ATTRIB) m |= IN_ATTRIB;
+        if (fan_mask & FAN_CLOSE_WRITE) m |= IN_CLOSE_WRITE;
+        if (fan_mask & FAN_ONDIR) m |= IN_ISDIR;
+        return m;
+    }
+    static std::string handle_key (const void *fsid, const struct file_handle *fh) {
+        std::string key ((const char *) fsid, 8);
+        key.append ((const char *) &fh->handle_type, sizeof (fh->handle_type));
+        key.append ((const char *) fh->f_handle, fh->handle_bytes);
+        return key;
+    }
+public:
+    FanotifyBackend() : fd (-1), next_wd (1) {}
+    ~FanotifyBackend() { close(); }
+
+    int init() {
+        fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK, O_RDONLY);
+        return fd;
+    }
+    int add_watch (const char *path, uint32_t mask) {
+        union { struct file_handle fh; char space[sizeof (struct file_handle) + MAX_HANDLE_SZ]; } h;
+        struct statfs sfs;
+        int mount_id;
+        h.fh.handle_bytes = MAX_HANDLE_SZ;
+        if (name_to_handle_at (AT_FDCWD, path, &h.fh, &mount_id, 0) < 0 || statfs (path, &sfs) < 0)
+            return -1;
+        std::string key = handle_key (&sfs.f_fsid, &h.fh);
+        std::map<std::string, int>::iterator hi = handles.find (key);
+        // Watching again replaces the mask, as with inotify, unless IN_MASK_ADD is given.
+        uint32_t old = hi != handles.end() ? masks[hi->second] : 0;
+        if (mask & IN_MASK_ADD)
+            mask = (mask & ~IN_MASK_ADD) | old;
+        uint64_t dirent = dirent_bits (mask), child = child_bits (mask);
+        uint64_t gone_dirent = dirent_bits (old) & ~dirent, gone_child = child_bits (old) & ~child;
+        if ((dirent && fanotify_mark (fd, FAN_MARK_ADD, dirent, AT_FDCWD, path) < 0) ||
+            (child && fanotify_mark (fd, FAN_MARK_ADD, child, AT_FDCWD, path) < 0))
+            return -1;
+        if (gone_dirent)
+            fanotify_mark (fd, FAN_MARK_REMOVE, gone_dirent, AT_FDCWD, path);
+        if (gone_child)
+            fanotify_mark (fd, FAN_MARK_REMOVE, gone_child, AT_FDCWD, path);
+        int wd = hi != handles.end() ? hi->second : next_wd++;
+        handles[key] = wd;
+        paths[wd] = path;
+        masks[wd] = mask;
+        return wd;
+    }
+    // The directory is usually gone already, and its marks with it.
+    int rm_watch (int wd) {
+        std::map<int, std::string>::iterator pi = paths.find (wd);
+        if (pi == paths.end()) {
+            errno = EINVAL;
+            return -1;
+        }
+        uint64_t dirent = dirent_bits (masks[wd]), child = child_bits (masks[wd]);
+        if (dirent)
+            fanotify_mark (fd, FAN_MARK_REMOVE, dirent, AT_FDCWD, pi->second.c_str());
+        if (child)
+            fanotify_mark (fd, FAN_MARK_REMOVE, child, AT_FDCWD, pi->second.c_str());
+        for (std::map<std::string, int>::iterator hi = handles.begin(); hi != handles.end(); hi++) {
+            if (hi->second == wd) {
+                handles.erase (hi);
+                break;
+            }
+        }
+        paths.erase (pi);
+        masks.erase (wd);
+        return 0;
+    }
+    int wait (int timeout_ms = -1) {
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        FD_ZERO (&watch_set);
+        FD_SET (fd, &watch_set);
+        return select (fd+1, &watch_set, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    }
+    // Translated events are always smaller than the fanotify records they come from, so reading
+    // at most len bytes of those always fits.
+    ssize_t read (char *buffer, size_t len) {
+        ssize_t n = ::read (fd, raw, len < sizeof (raw) ? len : sizeof (raw));
+        if (n <= 0)
+            return n;
+        size_t used = 0;
+        struct fanotify_event_metadata *md = (struct fanotify_event_metadata *) raw;
+        for (; FAN_EVENT_OK (md, n); md = FAN_EVENT_NEXT (md, n)) {
+            if (md->mask & FAN_Q_OVERFLOW) {
+                used = pack_event (buffer, used, len, -1, IN_Q_OVERFLOW, 0, NULL);
+                continue;
+            }
+            char *end = (char *) md + md->event_len;
+            char *p = (char *) (md + 1);
+            while (p + sizeof (struct fanotify_event_info_header) <= end) {
+                struct fanotify_event_info_fid *info = (struct fanotify_event_info_fid *) p;
+                if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                    struct file_handle *fh = (struct file_handle *) info->handle;
+                    const char *name = (const char *) (fh->f_handle + fh->handle_bytes);
+                    std::map<std::string, int>::iterator hi = handles.find (handle_key (&info->fsid, fh));
+                    if (hi != handles.end() && strcmp (name, "."))
+                        used = pack_event (buffer, used, len, hi->second, in_bits (md->mask), 0, name);
+                }
+                if (!info->hdr.len)
+                    break;
+                p += info->hdr.len;
+            }
+        }
+        // Nothing in the batch was about a watched directory: not an error, just no events.
+        return used;
+    }
+    int get_fd() const { return fd; }
+    void close() {
+        if (fd >= 0)
+            ::close (fd);
+        fd = -1;
+    }
+};
+#endif
+
+// No kernel notification at all: every interval, each watched directory is listed again and
+// compared with the previous listing (snapdiff.h). New names become IN_CREATE, vanished ones
+// IN_DELETE and changed size or mtime IN_MODIFY (IN_ISDIR set for directories), as far as the
+// watch mask asks for them. Works on any filesystem, including network ones, at the cost of
+// latency and CPU proportional to the tree.
+class PollingBackend {
+    struct watched {
+        std::string path;
+        uint32_t mask;
+        Snapshot last;
+    };
+    std::map<int, watched> dirs;
+    std::map<std::string, int> by_path;
+    std::deque<std::pair<int, std::pair<uint32_t, std::string> > > events;
+    int next_wd;
+    int interval_ms;
+    Snapshot now;
+    SnapshotDiff diff;
+
+    void queue (int wd, uint32_t mask, uint32_t want, const std::string &name) {
+        if (mask & want & ~IN_ISDIR)
+            events.push_back (std::make_pair (wd, std::make_pair (mask, name)));
+    }
+    // Rescan every watched directory and queue the differences (snapdiff.h). Removals come
+    // first, so a name whose inode changed reads as a delete and then a create.
+    void rescan() {
+        for (std::map<int, watched>::iterator di = dirs.begin(); di != dirs.end(); di++) {
+            watched &w = di->second;
+            if (!now.list (w.path))
+                continue;
+            snapshot_diff (w.last, now, diff);
+            for (size_t i = 0; i < diff.removed.size(); i++) {
+                uint32_t at = diff.removed[i];
+                queue (di->first, IN_DELETE | (w.last.dir[at] ? IN_ISDIR : 0), w.mask, w.last.name (at));
+            }
+            for (size_t i = 0; i < diff.added.size(); i++) {
+                uint32_t at = diff.added[i];
+                queue (di->first, IN_CREATE | (now.dir[at] ? IN_ISDIR : 0), w.mask, now.name (at));
+            }
+            for (size_t i = 0; i < diff.changed.size(); i++)
+                if (!now.dir[diff.changed[i]])
+                    queue (di->first, IN_MODIFY, w.mask, now.name (diff.changed[i]));
+            std::swap (w.last, now);
+        }
+    }
+public:
+    explicit PollingBackend (int interval_ms = 100) : next_wd (1), interval_ms (interval_ms) {}
+
+    int init() { return 0; }
+    int add_watch (const char *path, uint32_t mask) {
+        std::map<std::string, int>::iterator pi = by_path.find (path);
+        if (pi != by_path.end()) {
+            uint32_t &current = dirs[pi->second].mask;
+            current = mask & IN_MASK_ADD ? current | (mask & ~IN_MASK_ADD) : mask;
+            return pi->second;
+        }
+        watched w;
+        w.path = path;
+        w.mask = mask;
+        if (!w.last.list (path))
+            return -1;
+        int wd = next_wd++;
+        dirs[wd] = w;
+        by_path[path] = wd;
+        return wd;
+    }
+    int rm_watch (int wd) {
+        std::map<int, watched>::iterator di = dirs.find (wd);
+        if (di == dirs.end()) {
+            errno = EINVAL;
+            return -1;
+        }
+        by_path.erase (di->second.path);
+        dirs.erase (di);
+        return 0;
+    }
+    // Poll every interval_ms until something changed or timeout_ms passed.
+    int wait (int timeout_ms = -1) {
+        for (int waited = 0; events.empty(); waited += interval_ms) {
+            if (timeout_ms >= 0 && waited >= timeout_ms)
+                return 0;
+            int nap = timeout_ms >= 0 && timeout_ms - waited < interval_ms ? timeout_ms - waited : interval_ms;
+            struct timespec ts = {nap / 1000, (nap % 1000) * 1000000L};
+            if (nanosleep (&ts, NULL) < 0)
+                return -1;
+            rescan();
+        }
+        return 1;
+    }
+    ssize_t read (char *buffer, size_t len) {
+        size_t used = 0;
+        while (!events.empty()) {
+            size_t next = pack_event (buffer, used, len, events.front().first, events.front().second.first,
+                                      0, events.front().second.second.c_str());
+            if (next == used)
+                break;
+            used = next;
+            events.pop_front();
+        }
+        if (!used) {
+            errno = events.empty() ? EAGAIN : EINVAL;
+            return -1;
+        }
+        return used;
+    }
+    int get_fd() const { return -1; }
+    void close() {}
+};
+
+#endif
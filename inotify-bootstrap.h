@@ -0,0 +1,341 @@
+//
+// File:   inotify-bootstrap.h
+//
+// Bootstrap walker: watches the directories that already exist under a root, which the
+// event loop alone cannot do (it only learns about directories as they are created).
+//
+// Huge trees take a long time to walk, and a plain breadth- or depth-first walk covers
+// cold archives as early as the directories that are actually busy. Instead, the walker keeps
+// its frontier in a priority queue ordered by directory mtime, most recent first, so the
+// active parts of the tree are watched within seconds. Readiness is published per subtree:
+// once a directory and everything below it is watched, the ready callback passed to step()
+// is called for it, and ready (wd) answers true from then on. The callback for a root is the
+// "fully covered" marker for that root.
+//
+// The walk is incremental, so the event loop can run between calls to step() and deliver
+// events long before the walk is over. Directories then turn up from two sides: the walker
+// lists them, and IN_CREATE events report them (hand those to discovered()). Each (parent,
+// name) is known to the walker once, so a directory is never watched or scanned twice, and
+// each directory carries the generation it was discovered in, so a queued scan of a
+// directory that has since been deleted (and maybe re-created) is recognised as stale. The
+// node of a deleted directory, and those below it, are freed for new directories to reuse.
+//
+// The walker is a template over a backend (inotify-backend.h) and over the watch storage,
+// which only needs insert (pd, name, wd), as the Watch class in inotify-example.cpp has.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef INOTIFY_BOOTSTRAP_H
+#define INOTIFY_BOOTSTRAP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+template <class Backend, class Storage>
+class Bootstrap {
+    // One per directory seen; outstanding counts children not yet fully watched.
+    struct node {
+        int parent;         // index into nodes, -1 for a root
+        int wd;
+        uint32_t mask;      // what the watch reports; children inherit it
+        int outstanding;
+        int dirs;           // directories in this subtree watched so far
+        unsigned gen;       // scan generation, 0 once the directory is gone
+        bool scanned;
+        bool complete;
+        bool report;        // false for directories created after their parent was covered
+        std::string path;
+    };
+    struct pending {
+        struct timespec mtime;
+        int node;
+        unsigned gen;
+        bool operator< (const pending &r) const {
+            return mtime.tv_sec < r.mtime.tv_sec ||
+                (mtime.tv_sec == r.mtime.tv_sec && mtime.tv_nsec < r.mtime.tv_nsec);
+        }
+    };
+    typedef std::pair<int, std::string> child_key;     // (parent node, name)
+    Backend &in;
+    Storage &storage;
+    uint32_t flags;
+    bool list;
+    unsigned gen;
+    std::vector<node> nodes;
+    std::priority_queue<pending> queue;
+    std::map<child_key, int> known;
+    std::map<int, int> by_wd;       // wd -> node
+    std::vector<int> done;          // nodes whose subtree just completed, for step() to report
+    std::vector<int> spare;         // freed nodes, for push() to reuse
+public:
+    // With list false the walker never reads the filesystem: roots and discovered directories
+    // are only watched, which is what scripted backends need.
+    Bootstrap (Backend &in, Storage &storage, uint32_t flags, bool list = true)
+        : in (in), storage (storage), flags (flags), list (list), gen (0) {}
+
+    // Watch a root and queue its scan ahead of everything else. Returns the root's wd, or -1
+    // if it could not be watched.
+    int add_root (const std::string &path) {
+        struct timespec forever = {INT64_MAX, 0};
+        int n = push (-1, path, forever);
+        watch (n);
+        return nodes[n].wd;
+    }
+
+    // A directory reported by an IN_CREATE event under watched directory pd. It is watched
+    // right away, and its contents (which may have been created before the watch) are queued
+    // ahead of everything else. If the walker already knows it, nothing happens. Returns the
+    // directory's wd, or -1 if it could not be watched.
+    int discovered (int pd, const std::string &name) {
+        std::map<int, int>::iterator pi = by_wd.find (pd);
+        if (pi == by_wd.end())
+            return -1;
+        int parent = pi->second;
+        std::map<child_key, int>::iterator ki = known.find (child_key (parent, name));
+        if (ki != known.end())
+            return nodes[ki->second].wd;
+        struct timespec forever = {INT64_MAX, 0};
+        int n = push (parent, nodes[parent].path + "/" + name, forever);
+        watch (n);
+        return nodes[n].wd;
+    }
+
+    // A directory under pd was deleted: drop it, and any scan of it still queued.
+    void forget (int pd, const std::string &name) {
+        std::map<int, int>::iterator pi = by_wd.find (pd);
+        if (pi == by_wd.end())
+            return;
+        std::map<child_key, int>::iterator ki = known.find (child_key (pi->second, name));
+        if (ki == known.end())
+            return;
+        int n = ki->second;
+        known.erase (ki);
+        nodes[n].gen = 0;
+        if (!nodes[n].complete)
+            complete (n);
+        release (n);
+    }
+
+    // Watched directory name under pd was renamed to to_name under to: the node moves along,
+    // and the paths below it change with it. A subtree still being walked no longer holds up
+    // its old parent, and isn't reported ready under the new one.
+    void moved (int pd, const std::string &name, int to, const std::string &to_name) {
+        std::map<int, int>::iterator pi = by_wd.find (pd), ti = by_wd.find (to);
+        if (pi == by_wd.end() || ti == by_wd.end())
+            return;
+        std::map<child_key, int>::iterator ki = known.find (child_key (pi->second, name));
+        if (ki == known.end())
+            return;
+        int n = ki->second, old = pi->second, parent = ti->second;
+        known.erase (ki);
+        known[child_key (parent, to_name)] = n;
+        if (!nodes[n].complete && nodes[n].report && !nodes[old].complete) {
+            nodes[n].report = false;
+            if (--nodes[old].outstanding == 0 && nodes[old].scanned)
+                complete (old);
+        }
+        nodes[n].parent = parent;
+        repath (n, nodes[parent].path + "/" + to_name);
+    }
+
+    // Stop walking root wd: forget it and every directory below it, including scans still
+    // queued. Removing the watches themselves is up to the caller.
+    void drop_root (int wd) {
+        std::map<int, int>::iterator ri = by_wd.find (wd);
+        if (ri == by_wd.end() || nodes[ri->second].parent != -1)
+            return;
+        release (ri->second);
+    }
+
+    // Watch and list up to budget directories, most recently modified first, calling ready
+    // (path, wd, dirs) for each subtree that became fully watched. Returns the directories
+    // still queued, so callers can interleave walking with other work.
+    template <class Ready>
+    size_t step (size_t budget, Ready ready) {
+        while (budget > 0 && !queue.empty()) {
+            pending p = queue.top();
+            queue.pop();
+            if (nodes[p.node].gen != p.gen)
+                continue;
+            if (nodes[p.node].wd < 0)
+                watch (p.node);
+            if (nodes[p.node].wd >= 0)
+                scan (p.node);
+            budget--;
+        }
+        for (size_t i = 0; i < done.size(); i++) {
+            const node &d = nodes[done[i]];
+            if (d.report)
+                ready (d.path, d.wd, d.dirs);
+        }
+        done.clear();
+        return queue.size();
+    }
+
+    // True once wd and every directory below it are watched.
+    bool ready (int wd) const {
+        std::map<int, int>::const_iterator wi = by_wd.find (wd);
+        return wi != by_wd.end() && nodes[wi->second].complete;
+    }
+    size_t queued() const { return queue.size(); }
+
+    // The mask wd was watched with. set_mask() records a change made to it, which directories
+    // watched below it from then on inherit.
+    uint32_t mask (int wd) const {
+        std::map<int, int>::const_iterator wi = by_wd.find (wd);
+        return wi == by_wd.end() ? flags : nodes[wi->second].mask;
+    }
+    void set_mask (int wd, uint32_t mask) {
+        std::map<int, int>::iterator wi = by_wd.find (wd);
+        if (wi != by_wd.end())
+            nodes[wi->second].mask = mask;
+    }
+
+    // Rough bytes held, for the memory budget (membudget.h). The walk state is needed until the
+    // walk is over, so there is nothing to relieve.
+    size_t usage() const {
+        return nodes.capacity() * sizeof (node) + nodes.size() * 32 + known.size() * 96 +
+            by_wd.size() * 48 + queue.size() * sizeof (pending) + spare.capacity() * sizeof (int);
+    }
+    size_t relieve (int, size_t) { return 0; }
+
+private:
+    int push (int parent, const std::string &path, const struct timespec &mtime) {
+        node nd = {parent, -1, 0, 0, 0, ++gen, false, false, true, path};
+        if (parent >= 0) {
+            if (nodes[parent].complete)
+                nd.report = false;
+            else
+                nodes[parent].outstanding++;
+        }
+        int n = nodes.size();
+        if (spare.empty()) {
+            nodes.push_back (nd);
+        } else {
+            n = spare.back();
+            spare.pop_back();
+            nodes[n] = nd;
+        }
+        if (parent >= 0)
+            known[child_key (parent, path.substr (path.rfind ('/') + 1))] = n;
+        pending p = {mtime, n, nd.gen};
+        queue.push (p);
+        return n;
+    }
+
+    void watch (int n) {
+        int parent = nodes[n].parent;
+        uint32_t mask = parent >= 0 && nodes[parent].wd >= 0 ? nodes[parent].mask : flags;
+        int wd = in.add_watch (nodes[n].path.c_str(), mask);
+        if (wd < 0) {
+            printf ("Cannot watch %s: %s\n", nodes[n].path.c_str(), strerror (errno));
+            // Forget it, so a later event for the same name gets another try.
+            if (nodes[n].parent >= 0)
+                known.erase (child_key (nodes[n].parent, nodes[n].path.substr (nodes[n].path.rfind ('/') + 1)));
+            nodes[n].gen = 0;
+            complete (n);
+            release (n);
+            return;
+        }
+        nodes[n].wd = wd;
+        nodes[n].mask = mask;
+        nodes[n].dirs = 1;
+        by_wd[wd] = n;
+        if (parent < 0) {
+            storage.insert (-1, nodes[n].path, wd);
+        } else {
+            const std::string &path = nodes[n].path;
+            storage.insert (nodes[parent].wd, path.substr (path.rfind ('/') + 1), wd);
+        }
+    }
+
+    // List a watched directory, queueing subdirectories the walker doesn't know yet. The
+    // watch went on first, so anything created from then on is reported as an event instead.
+    void scan (int n) {
+        DIR *dir = list ? opendir (nodes[n].path.c_str()) : NULL;
+        if (dir) {
+            while (struct dirent *de = readdir (dir)) {
+                if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+                    continue;
+                if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+                    continue;
+                if (known.count (child_key (n, de->d_name)))
+                    continue;
+                std::string child = nodes[n].path + "/" + de->d_name;
+                struct stat st;
+                if (lstat (child.c_str(), &st) < 0 || !S_ISDIR (st.st_mode))
+                    continue;
+                push (n, child, st.st_mtim);
+            }
+            closedir (dir);
+        }
+        nodes[n].scanned = true;
+        if (nodes[n].outstanding == 0)
+            complete (n);
+    }
+
+    // Directory n is gone, or no longer walked: free its node and those below it. Queued scans
+    // of them are stale by their generation, even once the nodes are reused.
+    void release (int n) {
+        std::vector<int> below;
+        std::map<child_key, int>::iterator ki = known.lower_bound (child_key (n, ""));
+        while (ki != known.end() && ki->first.first == n) {
+            below.push_back (ki->second);
+            known.erase (ki++);
+        }
+        for (size_t i = 0; i < below.size(); i++)
+            release (below[i]);
+        node &d = nodes[n];
+        if (d.parent >= 0) {
+            ki = known.find (child_key (d.parent, d.path.substr (d.path.rfind ('/') + 1)));
+            if (ki != known.end() && ki->second == n)
+                known.erase (ki);
+        }
+        // wds of directories gone earlier may have been reused elsewhere.
+        std::map<int, int>::iterator wi = by_wd.find (d.wd);
+        if (wi != by_wd.end() && wi->second == n)
+            by_wd.erase (wi);
+        d.gen = 0;
+        d.wd = -1;
+        d.complete = true;
+        std::string().swap (d.path);
+        done.erase (std::remove (done.begin(), done.end(), n), done.end());
+        spare.push_back (n);
+    }
+    // Directory n is now at path, and so is everything below it.
+    void repath (int n, const std::string &path) {
+        nodes[n].path = path;
+        std::map<child_key, int>::iterator ki = known.lower_bound (child_key (n, ""));
+        for (; ki != known.end() && ki->first.first == n; ki++)
+            repath (ki->second, path + "/" + ki->first.second);
+    }
+
+    // Subtree n is fully watched (or gone): publish it and let the parent know, which may
+    // complete it too.
+    void complete (int n) {
+        while (n >= 0 && !nodes[n].complete) {
+            nodes[n].complete = true;
+            if (nodes[n].gen)
+                done.push_back (n);
+            int parent = nodes[n].parent;
+            if (parent < 0 || nodes[parent].complete || !nodes[n].report)
+                break;
+            nodes[parent].dirs += nodes[n].dirs;
+            if (--nodes[parent].outstanding > 0 || !nodes[parent].scanned)
+                break;
+            n = parent;
+        }
+    }
+};
+
+#endif
@@ -4,11 +4,12 @@
 // Author: Peter Krnjevic <pkrnjevic@gmail.com>, on the shoulders of many others
 //
 // This is a simple inotify sample program monitoring changes to "./tmp" directory (create ./tmp beforehand)
-// Recursive monitoring of file and directory create and delete events is implemented, but
-// monitoring pre-existing "./tmp" subfolders is not.
-// A C++ class containing a couple of maps is used to simplify monitoring.
-// The Watch class is minimally integrated, so as to leave the main inotify code
-// easily recognizeable.
+// Recursive monitoring of file and directory create and delete events is implemented, and
+// pre-existing "./tmp" subfolders are watched by a bootstrap walker (inotify-bootstrap.h),
+// most recently modified first.
+// A C++ class containing a couple of maps (watch.h) is used to simplify monitoring.
+// The event loop itself lives in watcher.h, as a Watcher template assembled from policies
+// (backend, storage, filter, sink); this file just picks a pipeline and runs it.
 //
 // *N.B.*
 // 1. This code is meant to illustrate inotify usage, and not intended to be
@@ -28,203 +29,266 @@
 // To run:
 //    $ ./inotify-example
 //
+// To replay a script of fake kernel events instead (see FakeBackend in inotify-backend.h):
+//    $ ./inotify-example -f events.script
+//
+// To print per-directory event counts every 10 seconds instead of each event (rollup.h),
+// with directories cut at <depth> components below ./tmp, and if <megabytes> is given, one
+// component shallower while the process is over that:
+//    $ ./inotify-example -r <depth> [megabytes]
+//
+// To watch only the files listed in a file, one path per line, at the cost of one watch per
+// parent directory (fileset.h):
+//    $ ./inotify-example -l <list>
+//
+// To keep the process under a hard RSS cap, shrinking buffers and shedding file events as
+// it is approached (membudget.h):
+//    $ ./inotify-example -m <megabytes>
+//
+// To see what watching ./tmp (or the given roots) would take, without watching anything:
+// directories, watches against the limit, kernel and user memory, bootstrap time and the
+// subtrees worth excluding (capacity.h), scanned with <threads> threads (the cost of a watch is
+// timed on a scratch directory it makes in $TMPDIR or /tmp):
+//    $ ./inotify-example -n <threads> [root ...]
+//
+// To journal every event to segments in directory <dir> (journal.h, journalset.h: 16 MB or
+// 10 minutes a segment, compacted after an hour, kept a day), and to ask a journal what
+// changed under <prefix> (e.g. ./tmp/a) between two times, in seconds since the epoch:
+//    $ ./inotify-example -j <dir>
+//    $ ./inotify-example -q <dir> <prefix> [from [to]]
+//
+// To print each event with the file's size, mode, inode and mtime, stat'ed in batches through
+// io_uring (enrich.h):
+//    $ ./inotify-example -s
+//
+// To keep a digest of each directory's subtree, names and metadata, up to date with the
+// events (merkle.h), and print the digest of ./tmp when done:
+//    $ ./inotify-example -d
+//
+// To take roots, masks and exclude patterns from a configuration file (config.h), and apply
+// changes to it on SIGHUP without re-watching what didn't change:
+//    $ ./inotify-example -c <config>
+//    $ kill -HUP <pid>
+//
 // To exit:
 //    control-C
 //
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
-#include <limits.h>
-#include <sys/inotify.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <iostream>
-#include <string>
-#include <map>
-
-using std::map;
-using std::string;
-using std::cout;
-using std::endl;
-
-#define EVENT_SIZE          (sizeof (struct inotify_event))
-#define EVENT_BUF_LEN       (1024 * (EVENT_SIZE + NAME_MAX + 1))
-#define WATCH_FLAGS         (IN_CREATE | IN_DELETE)
+
+#include "watcher.h"
+#include "rollup.h"
+#include "fileset.h"
+#include "capacity.h"
+#include "journalset.h"
+#include "enrich.h"
+#include "config.h"
+#include "merkle.h"
 
 // Keep going  while run == true, or, in other words, until user hits ctrl-c
 static bool run = true;
 
-void sig_callback (int sig)
+void sig_callback (int)
 {
     run = false;
 }
 
-// Watch class keeps track of watch descriptors (wd), parent watch descriptors (pd), and names (from event->name).
-// The class provides some helpers for inotify, primarily to enable recursive monitoring:
-// 1. To add a watch (inotify_add_watch), a complete path is needed, but events only provide file/dir name with no path.
-// 2. Delete events provide parent watch descriptor and file/dir name, but removing the watch (infotify_rm_watch) needs a wd.
-//
-class Watch {
-    struct wd_elem {
-        int pd;
-        string name;
-        bool operator() (const wd_elem &l, const wd_elem &r) const
-            { return l.pd < r.pd ? true : l.pd == r.pd && l.name < r.name ? true : false; }
-    };
-    map<int, wd_elem> watch;
-    map<wd_elem, int, wd_elem> rwatch;
-public:
-    // Insert event information, used to create new watch, into Watch object.
-    void insert (int pd, const string &name, int wd) {
-        wd_elem elem = {pd, name};
-        watch[wd] = elem;
-        rwatch[elem] = wd;
-    }
-    // Erase watch specified by pd (parent watch descriptor) and name from watch list.
-    // Returns full name (for display etc), and wd, which is required for inotify_rm_watch.
-    string erase (int pd, const string &name, int *wd) {
-        wd_elem pelem = {pd, name};
-        *wd = rwatch[pelem];
-        rwatch.erase (pelem);
-        const wd_elem &elem = watch[*wd];
-        string dir = elem.name;
-        watch.erase (*wd);
-        return dir;
-    }
-    // Given a watch descriptor, return the full directory name as string. Recurses up parent WDs to assemble name,
-    // an idea borrowed from Windows change journals.
-    string get (int wd) {
-        const wd_elem &elem = watch[wd];
-        return elem.pd == -1 ? elem.name : this->get (elem.pd) + "/" + elem.name;
-    }
-    // Given a parent wd and name (provided in IN_DELETE events), return the watch descriptor.
-    // Main purpose is to help remove directories from watch list.
-    int get (int pd, string name) {
-        wd_elem elem = {pd, name};
-        return rwatch[elem];
-    }
-    void cleanup (int fd) {
-        for (map<int, wd_elem>::iterator wi = watch.begin(); wi != watch.end(); wi++) {
-            inotify_rm_watch (fd, wi->first);
-            watch.erase (wi);
-        }
-        rwatch.clear();
-    }
-    void stats() {
-        cout << "number of watches=" << watch.size() << " & reverse watches=" << rwatch.size() << endl;
-    }
-};
+// Set on SIGHUP: reload the configuration file.
+static volatile bool reload = false;
+
+void hup_callback (int)
+{
+    reload = true;
+}
 
-int main()
+// Run a watcher on root until the user hits ctrl-c or the backend runs dry, then clean up.
+template <class W>
+int watch_loop (W &watcher, const char *root)
 {
-    // std::map used to keep track of wd (watch descriptors) and directory names
-    // As directory creation events arrive, they are added to the Watch map.
-    // Directory delete events should be (but currently aren't in this sample) handled the same way.
-    Watch watch;
+    // creating the INOTIFY instance
+    if (watcher.init() < 0)
+        return 1;
 
-    // watch_set is used by select to wait until inotify returns some data to
-    // be read using non-blocking read.
-    fd_set watch_set;
+    // add root to watch list. The walker adds what is already below it in the background.
+    if (watcher.add_root (root) < 0)
+        return 1;
 
-    char buffer[ EVENT_BUF_LEN ];
-    string current_dir, new_dir;
-    int total_file_events = 0;
-    int total_dir_events = 0;
+    // Continue until run == false. See signal and sig_callback above.
+    watcher.run (run);
 
+    // Cleanup
+    printf ("cleaning up\n");
+    watcher.stats();
+    watcher.cleanup();
+    watcher.storage().stats();
+    fflush (stdout);
+    return 0;
+}
+
+// The same under a memory budget, checked once per turn.
+template <class W>
+int budget_loop (W &watcher, MemoryBudget &budget, const char *root)
+{
+    if (watcher.init() < 0 || watcher.add_root (root) < 0)
+        return 1;
+    while (run && watcher.poll (1000) >= 0)
+        budget.check();
+    budget.stats();
+    printf ("cleaning up\n");
+    watcher.stats();
+    watcher.cleanup();
+    return 0;
+}
+
+static void print_record (const journal_record *r)
+{
+    time_t t = r->time / 1000000000;
+    char when[32];
+    strftime (when, sizeof (when), "%F %T", localtime (&t));
+    printf ("%s.%06u %08x %.*s\n", when, (unsigned) (r->time % 1000000000 / 1000), r->mask, (int) r->len, r->path);
+}
+
+int main (int argc, char *argv[])
+{
     // Call sig_callback if user hits ctrl-c
     signal (SIGINT, sig_callback);
 
-    // creating the INOTIFY instance
-// inotify_init1 not available with older kernels, consequently inotify reads block.
-// inotify_init1 allows directory events to complete immediately, avoiding buffering delays. In practice,
-// this significantly improves monotiring of newly created subdirectories.
-#ifdef IN_NONBLOCK
-    int fd = inotify_init1 (IN_NONBLOCK);
-#else
-    int fd = inotify_init();
-#endif
-
-    // checking for error
-    if (fd < 0) {
-        perror ("inotify_init");
+    // -f <script>: replay scripted events through FakeBackend, without touching the filesystem.
+    if (argc == 3 && !strcmp (argv[1], "-f")) {
+        static Watcher<FakeBackend> fake (WATCH_FLAGS, false);
+        FILE *script = fopen (argv[2], "r");
+        if (!script) {
+            perror (argv[2]);
+            return 1;
+        }
+        int loaded = fake.backend().load (script);
+        fclose (script);
+        if (loaded < 0)
+            return 1;
+        return watch_loop (fake, "./tmp");
     }
 
-    // use select watch list for non-blocking inotify read
-    FD_ZERO(&watch_set);
-    FD_SET(fd, &watch_set);
+    // -r <depth> [megabytes]: roll events up per directory prefix instead of printing each one.
+    if ((argc == 3 || argc == 4) && !strcmp (argv[1], "-r")) {
+        typedef Watcher<InotifyBackend, Watch, AcceptAll, RollupSink> RollupWatcher;
+        static RollupWatcher rollup;
+        rollup.sink().configure (atoi (argv[2]), 10);
+        rollup.sink().rollup.add_root ("./tmp");
+        if (argc == 3)
+            return watch_loop (rollup, "./tmp");
+        MemoryBudget budget (strtoul (argv[3], NULL, 0) << 20);
+        Budgeted<RollupWatcher> watched (rollup, "watcher");
+        Budgeted<Rollup> rows (rollup.sink().rollup, "rollup");
+        budget.add (&watched, 0);
+        budget.add (&rows, 1);
+        return budget_loop (rollup, budget, "./tmp");
+    }
 
-    // add “./tmp” to watch list. Normally, should check directory exists first
-    const char *root = "./tmp";
-    int wd = inotify_add_watch (fd, root, WATCH_FLAGS);
+    // -l <list>: watch just the listed files, through their parent directories.
+    if (argc == 3 && !strcmp (argv[1], "-l")) {
+        static FileSet files;
+        static Watcher<InotifyBackend, Watch, FileSetFilter> listed (FILESET_FLAGS, false);
+        FILE *list = fopen (argv[2], "r");
+        if (!list) {
+            perror (argv[2]);
+            return 1;
+        }
+        files.load (list);
+        fclose (list);
+        if (listed.init() < 0)
+            return 1;
+        files.add_watches (listed.backend(), listed.storage(), FILESET_FLAGS);
+        files.stats();
+        listed.filter().files = &files;
+        listed.run (run);
+        printf ("cleaning up\n");
+        listed.stats();
+        listed.cleanup();
+        return 0;
+    }
 
-    // add wd and directory name to Watch map
-    watch.insert (-1, root, wd);
+    // -n <threads> [root ...]: capacity-planning dry run.
+    if (argc >= 3 && !strcmp (argv[1], "-n")) {
+        std::vector<std::string> roots (argv + 3, argv + argc);
+        if (roots.empty())
+            roots.push_back ("./tmp");
+        CapacityPlan plan;
+        plan.scan (roots, atoi (argv[2]));
+        plan.report (stdout);
+        return 0;
+    }
 
-    // Continue until run == false. See signal and sig_callback above.
-    while (run) {
-        // select waits until inotify has 1 or more events.
-        // select syntax is beyond the scope of this sample but, don't worry, the fd+1 is correct:
-        // select needs the the highest fd (+1) as the first parameter.
-        select (fd+1, &watch_set, NULL, NULL, NULL);
-
-        // Read event (s) from non-blocking inotify fd (non-blocking specified in inotify_init1 above).
-        int length = read (fd, buffer, EVENT_BUF_LEN);
-        if (length < 0) {
-            perror ("read");
+    // -j <dir>: journal events.
+    if (argc == 3 && !strcmp (argv[1], "-j")) {
+        static Watcher<InotifyBackend, Watch, AcceptAll, JournalSink> journaled;
+        if (!journaled.sink().journal.open (argv[2])) {
+            perror (argv[2]);
+            return 1;
         }
+        return watch_loop (journaled, "./tmp");
+    }
 
-        // Loop through event buffer
-        for (int i=0; i<length;) {
-            struct inotify_event *event = (struct inotify_event *) &buffer[ i ];
-            // Never actually seen this
-            if (event->wd == -1) {
-               printf ("Overflow\n");
-            }
-            // Never seen this either
-            if (event->mask & IN_Q_OVERFLOW) {
-                  printf ("Overflow\n");
-            }
-            if (event->len) {
-                if (event->mask & IN_IGNORED) {
-                    printf ("IN_IGNORED\n");
-                }
-                if (event->mask & IN_CREATE) {
-                    current_dir = watch.get (event->wd);
-                    if (event->mask & IN_ISDIR) {
-                        new_dir = current_dir + "/" + event->name;
-                        wd = inotify_add_watch (fd, new_dir.c_str(), WATCH_FLAGS);
-                        watch.insert (event->wd, event->name, wd);
-                        total_dir_events++;
-                        printf ("New directory %s created.\n", new_dir.c_str());
-                    } else {
-                        total_file_events++;
-                        printf ("New file %s/%s created.\n", current_dir.c_str(), event->name);
-                    }
-                } else if (event->mask & IN_DELETE) {
-                    if (event->mask & IN_ISDIR) {
-                        new_dir = watch.erase (event->wd, event->name, &wd);
-                        inotify_rm_watch (fd, wd);
-                        total_dir_events--;
-                        printf ("Directory %s deleted.\n", new_dir.c_str());
-                    } else {
-                        current_dir = watch.get (event->wd);
-                        total_file_events--;
-                        printf ("File %s/%s deleted.\n", current_dir.c_str(), event->name);
-                    }
-                }
+    // -c <config>: roots and filters from a file, reloaded on SIGHUP.
+    if (argc == 3 && !strcmp (argv[1], "-c")) {
+        typedef Watcher<InotifyBackend, Watch, PatternFilter> ConfiguredWatcher;
+        static ConfiguredWatcher configured;
+        ConfigReloader<ConfiguredWatcher> config (configured, argv[2]);
+        signal (SIGHUP, hup_callback);
+        if (configured.init() < 0 || !config.reload())
+            return 1;
+        while (run && configured.poll (1000) >= 0) {
+            if (reload) {
+                reload = false;
+                config.reload();
             }
-            i += EVENT_SIZE + event->len;
         }
+        printf ("cleaning up\n");
+        configured.stats();
+        configured.cleanup();
+        return 0;
     }
 
-    // Cleanup
-    printf ("cleaning up\n");
-    cout << "total dir events = " << total_dir_events << ", total file events = " << total_file_events << endl;
-    watch.stats();
-    watch.cleanup (fd);
-    watch.stats();
-    close (fd);
-    fflush (stdout);
-}
+    // -s: enrich events with file metadata.
+    if (argc == 2 && !strcmp (argv[1], "-s")) {
+        static Watcher<InotifyBackend, Watch, AcceptAll, EnrichSink<PrintInfoSink> > enriched;
+        return watch_loop (enriched, "./tmp");
+    }
+
+    // -d: subtree digests.
+    if (argc == 2 && !strcmp (argv[1], "-d")) {
+        static Watcher<InotifyBackend, Watch, AcceptAll, EnrichSink<MerkleSink> > digested (MERKLE_EVENTS);
+        digested.sink().inner().storage = &digested.storage();
+        return watch_loop (digested, "./tmp");
+    }
 
+    // -q <dir> <prefix> [from [to]]: query a journal, while it is written or after.
+    if (argc >= 4 && !strcmp (argv[1], "-q")) {
+        JournalSetReader journal;
+        if (!journal.open (argv[2])) {
+            perror (argv[2]);
+            return 1;
+        }
+        uint64_t from = argc > 4 ? strtoull (argv[4], NULL, 0) * 1000000000ULL : 0;
+        uint64_t to = argc > 5 ? strtoull (argv[5], NULL, 0) * 1000000000ULL + 999999999 : UINT64_MAX;
+        size_t n = journal.query (argv[3], from, to, print_record);
+        printf ("%zu events, %lu blocks read, %lu skipped by their filter, %lu of %zu segments skipped\n", n,
+                journal.scanned, journal.skipped, journal.segments_skipped, journal.size());
+        return 0;
+    }
+
+    static Watcher<InotifyBackend> watcher;
+
+    // -m <megabytes>: run the default pipeline under a memory budget.
+    if (argc == 3 && !strcmp (argv[1], "-m")) {
+        MemoryBudget budget (strtoul (argv[2], NULL, 0) << 20);
+        Budgeted<Watcher<InotifyBackend> > budgeted (watcher, "watcher");
+        budget.add (&budgeted, 0);
+        return budget_loop (watcher, budget, "./tmp");
+    }
+
+    return watch_loop (watcher, "./tmp");
+}
@@ -0,0 +1,323 @@
+//
+// File:   inotify-instances.h
+//
+// Bounded inotify instance management. Each user may only hold fs.inotify.max_user_instances
+// inotify instances (128 by default), shared by every process they run. Giving every root or
+// subscription its own instance runs into that limit quickly, so InstancePool hands instances
+// out per key (a root, a subscription, ...) while it has headroom, shares the least loaded
+// instance once it is near the cap, and falls back to sharing rather than failing when
+// inotify_init1 itself runs out (EMFILE). rebalance() folds the smallest instances into their
+// neighbours to give instances back once the cap gets close. Since that closes instances,
+// acquire() hands out a handle that finds the key's instance on each use, not the instance.
+//
+// Keys sharing an instance may watch the same directory, and the kernel then hands back the
+// same wd to both. The pool keeps every owner of a wd with the mask it asked for: the kernel
+// mask is the union of them (added with IN_MASK_ADD, so one key never narrows another's), and
+// the watch is only removed when its last owner lets go.
+//
+// The pool is a template over the backends in inotify-backend.h, so it can be driven by
+// FakeBackend as well as by the kernel.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef INOTIFY_INSTANCES_H
+#define INOTIFY_INSTANCES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+#include <map>
+#include <vector>
+
+// Per-user limit on inotify instances, or def if it can't be read.
+inline int max_user_instances (int def = 128)
+{
+    FILE *f = fopen ("/proc/sys/fs/inotify/max_user_instances", "r");
+    int limit = def;
+    if (f) {
+        if (fscanf (f, "%d", &limit) != 1)
+            limit = def;
+        fclose (f);
+    }
+    return limit;
+}
+
+// Count the inotify instances held by processes of the current user, the same way
+// inotify.txt finds them: every fd that links to anon_inode:inotify. With watches, also count
+// the watches they hold, one "inotify wd:" line each in the fd's fdinfo.
+inline int user_instances (long *watches = NULL)
+{
+    if (watches)
+        *watches = 0;
+    int count = 0;
+    uid_t uid = getuid();
+    DIR *proc = opendir ("/proc");
+    if (!proc)
+        return 0;
+    while (struct dirent *pe = readdir (proc)) {
+        if (pe->d_name[0] < '0' || pe->d_name[0] > '9')
+            continue;
+        std::string fddir = std::string ("/proc/") + pe->d_name + "/fd";
+        struct stat st;
+        if (stat (fddir.c_str(), &st) < 0 || st.st_uid != uid)
+            continue;
+        DIR *fds = opendir (fddir.c_str());
+        if (!fds)
+            continue;
+        while (struct dirent *fe = readdir (fds)) {
+            char link[64];
+            std::string fd = fddir + "/" + fe->d_name;
+            ssize_t n = readlink (fd.c_str(), link, sizeof (link) - 1);
+            if (n > 0) {
+                link[n] = '\0';
+                if (std::string (link) != "anon_inode:inotify")
+                    continue;
+                count++;
+                std::string info = std::string ("/proc/") + pe->d_name + "/fdinfo/" + fe->d_name;
+                FILE *f = watches ? fopen (info.c_str(), "r") : NULL;
+                if (!f)
+                    continue;
+                char line[512];
+                while (fgets (line, sizeof (line), f))
+                    if (!strncmp (line, "inotify wd:", 11))
+                        (*watches)++;
+                fclose (f);
+            }
+        }
+        closedir (fds);
+    }
+    closedir (proc);
+    return count;
+}
+
+template <class Backend>
+class InstancePool {
+    struct watch {
+        std::string path;                           // to re-add it when rebalancing
+        std::map<std::string, uint32_t> owners;     // key -> mask it asked for
+        uint32_t mask() const {
+            uint32_t m = 0;
+            for (std::map<std::string, uint32_t>::const_iterator oi = owners.begin(); oi != owners.end(); oi++)
+                m |= oi->second;
+            return m;
+        }
+    };
+    struct instance {
+        Backend backend;
+        std::map<int, watch> watches;               // wd -> owners, to demultiplex shared instances
+        int keys;
+    };
+    std::vector<instance *> instances;
+    std::map<std::string, instance *> by_key;
+    int cap;
+public:
+    // A key's instance, looked up on each use: still good after rebalance() moved the key,
+    // NULL once the key is released.
+    class handle {
+        const InstancePool *pool;
+        std::string key;
+    public:
+        handle() : pool (NULL) {}
+        handle (const InstancePool *pool, const std::string &key) : pool (pool), key (key) {}
+        Backend *get() const { return pool ? pool->backend (key) : NULL; }
+        Backend *operator->() const { return get(); }
+    };
+
+    // cap: the most instances this pool may hold. By default, what is left of
+    // max_user_instances after other processes of this user, minus headroom for them to grow.
+    explicit InstancePool (int cap = -1, int headroom = 8) : cap (cap) {
+        if (this->cap < 0)
+            this->cap = max_user_instances() - user_instances() - headroom;
+        if (this->cap < 1)
+            this->cap = 1;
+    }
+    ~InstancePool() {
+        for (size_t i = 0; i < instances.size(); i++)
+            delete instances[i];
+    }
+
+    // Instance for key, creating one while under the cap and sharing the least loaded
+    // instance otherwise. The handle's get() is NULL only if no instance can be created at all.
+    handle acquire (const std::string &key) {
+        if (by_key.count (key))
+            return handle (this, key);
+        instance *in = NULL;
+        if ((int) instances.size() < cap) {
+            in = new instance;
+            in->keys = 0;
+            // Someone else may have taken the last instances: share instead of failing.
+            if (in->backend.init() < 0) {
+                delete in;
+                in = NULL;
+                if (errno != EMFILE || instances.empty())
+                    return handle();
+                cap = instances.size();
+            } else {
+                instances.push_back (in);
+            }
+        }
+        if (!in)
+            in = least_loaded (NULL);
+        in->keys++;
+        by_key[key] = in;
+        return handle (this, key);
+    }
+    // The instance key has right now, or NULL. Don't keep it across rebalance() or release().
+    Backend *backend (const std::string &key) const {
+        typename std::map<std::string, instance *>::const_iterator ki = by_key.find (key);
+        return ki == by_key.end() ? NULL : &ki->second->backend;
+    }
+
+    // Drop key's claim; its watches are removed, and the instance closed once unused.
+    void release (const std::string &key) {
+        typename std::map<std::string, instance *>::iterator ki = by_key.find (key);
+        if (ki == by_key.end())
+            return;
+        instance *in = ki->second;
+        by_key.erase (ki);
+        std::vector<int> owned;
+        for (typename std::map<int, watch>::iterator wi = in->watches.begin(); wi != in->watches.end(); wi++)
+            if (wi->second.owners.count (key))
+                owned.push_back (wi->first);
+        for (size_t i = 0; i < owned.size(); i++)
+            disown (in, owned[i], key);
+        if (--in->keys == 0)
+            close (in);
+    }
+
+    // Add or remove a watch for key on its instance. Going through the pool keeps track of
+    // which keys own which wd, and lets rebalance() move watches between instances. Adding
+    // again for the same key replaces that key's mask.
+    int add_watch (const std::string &key, const char *path, uint32_t mask) {
+        if (!acquire (key).get())
+            return -1;
+        return add (by_key[key], key, path, mask);
+    }
+    int rm_watch (const std::string &key, int wd) {
+        typename std::map<std::string, instance *>::iterator ki = by_key.find (key);
+        if (ki == by_key.end() || !ki->second->watches.count (wd) || !ki->second->watches[wd].owners.count (key)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return disown (ki->second, wd, key);
+    }
+
+    // Which keys an event read from a (possibly shared) instance belongs to: the owners of wd
+    // that asked for one of the event's bits. Events outside IN_ALL_EVENTS (IN_IGNORED,
+    // IN_UNMOUNT) go to every owner. Returns the number of keys.
+    size_t owners (const Backend *b, int wd, uint32_t mask, std::vector<std::string> &keys) const {
+        keys.clear();
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (&instances[i]->backend != b)
+                continue;
+            typename std::map<int, watch>::const_iterator wi = instances[i]->watches.find (wd);
+            if (wi == instances[i]->watches.end())
+                break;
+            const std::map<std::string, uint32_t> &o = wi->second.owners;
+            for (std::map<std::string, uint32_t>::const_iterator oi = o.begin(); oi != o.end(); oi++)
+                if (!(mask & IN_ALL_EVENTS) || (oi->second & mask & IN_ALL_EVENTS))
+                    keys.push_back (oi->first);
+            break;
+        }
+        return keys.size();
+    }
+
+    // When within margin of the cap, fold the instance with the fewest watches into the next
+    // least loaded one: its watches are re-added there and the instance is closed. moved (key,
+    // old_wd, new_wd) is called for every watch that changed instance, so the owner can update
+    // its Watch map; new_wd is -1 if the watch could not be re-added. Returns the number of
+    // instances given back. Backend pointers taken from backends() or backend() before the
+    // call may dangle after it; handles from acquire() stay good.
+    template <class Moved>
+    int rebalance (Moved moved, int margin = 2) {
+        int freed = 0;
+        while (instances.size() > 1 && (int) instances.size() > cap - margin) {
+            instance *from = least_loaded (NULL);
+            instance *to = least_loaded (from);
+            for (typename std::map<int, watch>::iterator wi = from->watches.begin(); wi != from->watches.end(); wi++) {
+                const std::map<std::string, uint32_t> &o = wi->second.owners;
+                for (std::map<std::string, uint32_t>::const_iterator oi = o.begin(); oi != o.end(); oi++)
+                    moved (oi->first, wi->first, add (to, oi->first, wi->second.path.c_str(), oi->second));
+            }
+            for (typename std::map<std::string, instance *>::iterator ki = by_key.begin(); ki != by_key.end(); ki++) {
+                if (ki->second == from) {
+                    ki->second = to;
+                    to->keys++;
+                }
+            }
+            close (from);
+            freed++;
+        }
+        return freed;
+    }
+
+    // Every live instance, e.g. to wait on all of their fds.
+    std::vector<Backend *> backends() const {
+        std::vector<Backend *> out;
+        for (size_t i = 0; i < instances.size(); i++)
+            out.push_back (&instances[i]->backend);
+        return out;
+    }
+    int size() const { return instances.size(); }
+    int limit() const { return cap; }
+    void stats() const {
+        printf ("inotify instances=%d/%d keys=%d\n", (int) instances.size(), cap, (int) by_key.size());
+    }
+
+private:
+    instance *least_loaded (const instance *except) const {
+        instance *best = NULL;
+        for (size_t i = 0; i < instances.size(); i++) {
+            instance *in = instances[i];
+            if (in != except && (!best || in->watches.size() < best->watches.size()))
+                best = in;
+        }
+        return best;
+    }
+    // key's claim on path in instance in. Never narrows what other owners asked for.
+    int add (instance *in, const std::string &key, const char *path, uint32_t mask) {
+        int wd = in->backend.add_watch (path, mask | IN_MASK_ADD);
+        if (wd < 0)
+            return wd;
+        watch &w = in->watches[wd];
+        w.path = path;
+        std::map<std::string, uint32_t>::iterator oi = w.owners.find (key);
+        uint32_t before = oi == w.owners.end() ? 0 : oi->second;
+        w.owners[key] = mask;
+        // key asked for less than before: take away what nobody else wants any more.
+        if (before & ~mask & ~w.mask())
+            in->backend.add_watch (path, w.mask());
+        return wd;
+    }
+    // Drop key's claim on wd: the watch goes with its last owner, else it is narrowed to what
+    // the others asked for.
+    int disown (instance *in, int wd, const std::string &key) {
+        typename std::map<int, watch>::iterator wi = in->watches.find (wd);
+        wi->second.owners.erase (key);
+        if (wi->second.owners.empty()) {
+            in->watches.erase (wi);
+            return in->backend.rm_watch (wd);
+        }
+        return in->backend.add_watch (wi->second.path.c_str(), wi->second.mask()) < 0 ? -1 : 0;
+    }
+    void close (instance *in) {
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (instances[i] == in) {
+                instances.erase (instances.begin() + i);
+                break;
+            }
+        }
+        in->backend.close();
+        delete in;
+    }
+};
+
+#endif
@@ -0,0 +1,355 @@
+//
+// File:   journal.h
+//
+// Event journal: every delivered event appended to a file, with enough indexing that "what
+// changed under /x between T1 and T2" is answered without reading the whole file.
+//
+// The file is a fixed number of fixed-size blocks, written in order. Each block starts with
+// a header holding the time range of its records and a Bloom filter of every path prefix
+// they touch (/a, /a/b, /a/b/c for an event on /a/b/c). The headers are the index: a query
+// binary-searches them by time, skips blocks whose filter rules the prefix out, and only
+// reads the records of the blocks left.
+//
+// Queries run on a read-only mmap of the file, in any process, and never block the writer.
+// The writer publishes a record by storing the block's record count with release semantics
+// after the record and its filter bits are in place, and readers load it with acquire, so a
+// reader sees whole records only. The filter may hold bits of records not yet published,
+// which costs a block scan at worst, never a wrong answer.
+//
+// Layout (native endianness):
+//
+//    file header       magic, version, block size, blocks, blocks in use, flags
+//    blocks            block header (times, count, bytes used, filter) then records
+//    record            time (ns since the epoch), mask, cookie, path length, name offset,
+//                      path (dir/name), padded to 8 bytes
+//
+// Events are timed when the watcher reads them (inotify events carry no time of their own),
+// with CLOCK_REALTIME held monotonic. Paths are stored as the watcher reports them, so query
+// prefixes take the same form as the roots (./tmp/a for a root of ./tmp).
+// When the last block is full the journal stops and counts what it drops; journalset.h rolls
+// over to a new file instead, and is what the JournalSink policy for Watcher writes to.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+
+#define JOURNAL_MAGIC           0x6a726e6c      // "jrnl"
+#define JOURNAL_VERSION         1
+#define JOURNAL_BLOCK_SIZE      (64 * 1024)
+#define JOURNAL_BLOOM_BYTES     1024
+#define JOURNAL_BLOOM_HASHES    4
+#define JOURNAL_SUMMARY         1       // compacted: net changes only (journalset.h)
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t used;              // blocks started so far
+    uint32_t flags;             // JOURNAL_SUMMARY
+};
+
+struct journal_block {
+    uint64_t first;             // time of the first and last record
+    uint64_t last;
+    uint32_t count;             // records published
+    uint32_t bytes;             // record bytes published
+    uint8_t bloom[JOURNAL_BLOOM_BYTES];
+};
+
+struct journal_record {
+    uint64_t time;
+    uint32_t mask;
+    uint32_t cookie;
+    uint16_t len;               // path length
+    uint16_t name;              // offset of the name in path
+    char path[];
+};
+
+// Component-wise prefix test: /a/b is under /a, /ab is not.
+static inline bool journal_under (const char *path, size_t len, const std::string &prefix)
+{
+    if (prefix.empty() || prefix == "/")
+        return true;
+    return len >= prefix.size() && !memcmp (path, prefix.data(), prefix.size()) &&
+        (len == prefix.size() || path[prefix.size()] == '/');
+}
+
+// Maps a journal file. Base of both the writer and the reader.
+class JournalFile {
+protected:
+    void *base;
+    size_t size;
+    journal_header *header;
+
+    static uint64_t hash (const char *s, size_t len) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+        return h;
+    }
+    // Bloom filter probes (double hashing over 64 bits).
+    static void probes (const char *s, size_t len, uint32_t bits[JOURNAL_BLOOM_HASHES]) {
+        uint64_t h = hash (s, len);
+        uint32_t a = h, b = (h >> 32) | 1;
+        for (int i = 0; i < JOURNAL_BLOOM_HASHES; i++)
+            bits[i] = (a + i * b) % (JOURNAL_BLOOM_BYTES * 8);
+    }
+    journal_block *block (uint32_t i) const {
+        return (journal_block *) ((char *) base + sizeof (journal_header) + (size_t) i * header->block_size);
+    }
+    bool map (int fd, size_t bytes, bool writable) {
+        size = bytes;
+        base = mmap (NULL, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+        ::close (fd);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            return false;
+        }
+        header = (journal_header *) base;
+        return true;
+    }
+public:
+    JournalFile() : base (NULL), size (0), header (NULL) {}
+    ~JournalFile() { close(); }
+    void close() {
+        if (base)
+            munmap (base, size);
+        base = NULL;
+        header = NULL;
+    }
+    bool is_open() const { return base != NULL; }
+    uint32_t flags() const { return header->flags; }
+    // Time of the first and the last published record; 0 if there are none.
+    uint64_t first() const {
+        return __atomic_load_n (&block (0)->count, __ATOMIC_ACQUIRE) ? block (0)->first : 0;
+    }
+    uint64_t last() const {
+        for (uint32_t i = __atomic_load_n (&header->used, __ATOMIC_ACQUIRE); i-- > 0; )
+            if (__atomic_load_n (&block (i)->count, __ATOMIC_ACQUIRE))
+                return __atomic_load_n (&block (i)->last, __ATOMIC_RELAXED);
+        return 0;
+    }
+    static bool in_filter (const journal_block *b, const char *s, size_t len) {
+        uint32_t bits[JOURNAL_BLOOM_HASHES];
+        probes (s, len, bits);
+        for (int i = 0; i < JOURNAL_BLOOM_HASHES; i++)
+            if (!(__atomic_load_n (&b->bloom[bits[i] >> 3], __ATOMIC_RELAXED) & (1 << (bits[i] & 7))))
+                return false;
+        return true;
+    }
+};
+
+class JournalWriter : public JournalFile {
+    std::string name;
+    uint32_t current;           // block being filled
+    uint64_t newest;            // time of the last record
+    bool exhausted;             // the last block is full
+    unsigned long written, dropped;
+
+    void add (journal_block *b, const char *path, size_t len) {
+        uint32_t bits[JOURNAL_BLOOM_HASHES];
+        probes (path, len, bits);
+        for (int i = 0; i < JOURNAL_BLOOM_HASHES; i++)
+            __atomic_fetch_or (&b->bloom[bits[i] >> 3], (uint8_t) (1 << (bits[i] & 7)), __ATOMIC_RELAXED);
+    }
+    // Room for a record with a path of len bytes, in *b. NULL if there is none.
+    journal_record *reserve (uint64_t time, size_t len, journal_block **b) {
+        size_t need = (sizeof (journal_record) + len + 7) & ~(size_t) 7;
+        if (!base || len > 0xffff || need > header->block_size - sizeof (journal_block)) {
+            dropped++;
+            return NULL;
+        }
+        *b = block (current);
+        if ((*b)->bytes + need > header->block_size - sizeof (journal_block)) {
+            if (current + 1 >= header->blocks) {
+                exhausted = true;
+                dropped++;
+                return NULL;
+            }
+            *b = block (++current);
+            __atomic_store_n (&header->used, current + 1, __ATOMIC_RELEASE);
+        }
+        journal_record *r = (journal_record *) ((char *) (*b + 1) + (*b)->bytes);
+        r->time = time;
+        r->len = len;
+        return r;
+    }
+    // Publish r, its path filled in, to readers.
+    void commit (journal_block *b, journal_record *r) {
+        // Every prefix of the path, so any ancestor directory finds the block.
+        for (size_t i = 1; i <= r->len; i++)
+            if (i == r->len || r->path[i] == '/')
+                add (b, r->path, i);
+        if (!b->count)
+            __atomic_store_n (&b->first, r->time, __ATOMIC_RELAXED);
+        __atomic_store_n (&b->last, r->time, __ATOMIC_RELAXED);
+        uint32_t need = (sizeof (journal_record) + r->len + 7) & ~(size_t) 7;
+        __atomic_store_n (&b->bytes, b->bytes + need, __ATOMIC_RELAXED);
+        __atomic_store_n (&b->count, b->count + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+public:
+    JournalWriter() : current (0), newest (0), exhausted (false), written (0), dropped (0) {}
+
+    // Create (or truncate) a journal of blocks blocks.
+    bool create (const char *path, uint32_t blocks, uint32_t flags = 0) {
+        close();
+        int fd = ::open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        size_t bytes = sizeof (journal_header) + (size_t) blocks * JOURNAL_BLOCK_SIZE;
+        if (ftruncate (fd, bytes) < 0) {
+            ::close (fd);
+            return false;
+        }
+        if (!map (fd, bytes, true))
+            return false;
+        journal_header h = {JOURNAL_MAGIC, JOURNAL_VERSION, JOURNAL_BLOCK_SIZE, blocks, 1, flags};
+        *header = h;
+        name = path;
+        current = 0;
+        exhausted = false;
+        return true;
+    }
+
+    // Append one event on path (dir/name) at time ns. False if it doesn't fit.
+    bool append (uint64_t time, uint32_t mask, uint32_t cookie, const std::string &dir, const char *name) {
+        // Keep times monotonic across clock steps, or the time index would be wrong.
+        if (time < newest)
+            time = newest;
+        newest = time;
+        size_t tail = strlen (name);
+        journal_block *b;
+        journal_record *r = reserve (time, dir.size() + 1 + tail, &b);
+        if (!r)
+            return false;
+        r->mask = mask;
+        r->cookie = cookie;
+        r->name = dir.size() + 1;
+        memcpy (r->path, dir.data(), dir.size());
+        r->path[dir.size()] = '/';
+        memcpy (r->path + dir.size() + 1, name, tail);
+        commit (b, r);
+        return true;
+    }
+    // Append a record read from another journal, as it is.
+    bool copy (const journal_record *from) {
+        journal_block *b;
+        journal_record *r = reserve (from->time, from->len, &b);
+        if (!r)
+            return false;
+        r->mask = from->mask;
+        r->cookie = from->cookie;
+        r->name = from->name;
+        memcpy (r->path, from->path, from->len);
+        if (from->time > newest)
+            newest = from->time;
+        commit (b, r);
+        return true;
+    }
+    // Done writing: give the unused blocks back to the filesystem. Readers that mapped the
+    // file before only ever look at used blocks.
+    void seal() {
+        if (!base)
+            return;
+        header->blocks = current + 1;
+        msync (base, size, MS_ASYNC);
+        if (truncate (name.c_str(), sizeof (journal_header) + (size_t) header->blocks * header->block_size) < 0)
+            perror (name.c_str());
+        close();
+    }
+    bool full() const { return exhausted; }
+    unsigned long count() const { return written; }
+    unsigned long lost() const { return dropped; }
+    uint32_t blocks_used() const { return header ? current + 1 : 0; }
+};
+
+// Query side, in any process.
+class JournalReader : public JournalFile {
+public:
+    unsigned long scanned, skipped;     // blocks read, blocks ruled out by their filter
+
+    JournalReader() : scanned (0), skipped (0) {}
+
+    bool open (const char *path) {
+        int fd = ::open (path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        journal_header h;
+        if (fstat (fd, &st) < 0 || pread (fd, &h, sizeof (h), 0) != (ssize_t) sizeof (h) ||
+            h.magic != JOURNAL_MAGIC || h.version != JOURNAL_VERSION || h.block_size < sizeof (journal_block) ||
+            (size_t) st.st_size < sizeof (h) + (size_t) h.blocks * h.block_size) {
+            ::close (fd);
+            errno = EINVAL;
+            return false;
+        }
+        return map (fd, sizeof (h) + (size_t) h.blocks * h.block_size, false);
+    }
+
+    // Might a block hold something under prefix? Blocks with an overflow always might.
+    bool may_contain (const journal_block *b, const std::string &prefix) const {
+        return prefix.empty() || prefix == "/" || in_filter (b, prefix.data(), prefix.size()) ||
+            in_filter (b, "/", 1);      // the path of overflow records
+    }
+
+    // Call found (const journal_record *) for each record under prefix (without a trailing
+    // slash; empty for everything) timed from..to inclusive, in time order. Overflow records
+    // in range are reported too: anything may have been lost there. Returns the match count.
+    template <class Found>
+    size_t query (const std::string &prefix, uint64_t from, uint64_t to, Found found) {
+        uint32_t used = __atomic_load_n (&header->used, __ATOMIC_ACQUIRE);
+        // First block whose last record is not before from.
+        uint32_t lo = 0, hi = used;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            const journal_block *b = block (mid);
+            if (__atomic_load_n (&b->count, __ATOMIC_ACQUIRE) && __atomic_load_n (&b->last, __ATOMIC_RELAXED) < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        size_t matches = 0;
+        for (uint32_t i = lo; i < used; i++) {
+            const journal_block *b = block (i);
+            uint32_t count = __atomic_load_n (&b->count, __ATOMIC_ACQUIRE);
+            if (!count || __atomic_load_n (&b->first, __ATOMIC_RELAXED) > to)
+                break;
+            if (!may_contain (b, prefix)) {
+                skipped++;
+                continue;
+            }
+            scanned++;
+            const char *p = (const char *) (b + 1);
+            for (uint32_t n = 0; n < count; n++) {
+                const journal_record *r = (const journal_record *) p;
+                p += (sizeof (journal_record) + r->len + 7) & ~(size_t) 7;
+                if (r->time < from || r->time > to)
+                    continue;
+                if ((r->mask & IN_Q_OVERFLOW) || journal_under (r->path, r->len, prefix)) {
+                    found (r);
+                    matches++;
+                }
+            }
+        }
+        return matches;
+    }
+
+};
+
+#endif
@@ -0,0 +1,484 @@
+//
+// File:   journalset.h
+//
+// The event journal (journal.h) as a directory of segments, so it doesn't grow forever:
+//
+//    segments      the writer starts a new file when the current one is full (size) or its
+//                  first record is older than a limit (time)
+//    compaction    closed segments older than a limit are merged into one summary segment
+//                  holding net changes only: a create and a later delete of the same path
+//                  cancel out (with whatever happened in between), and of several modifies
+//                  only the last is kept
+//    retention     the oldest segments are deleted past an age or a disk use limit
+//
+// Compaction and retention run on a background thread, on closed segments only, so ingestion
+// never waits for them. A summary is written to a temporary file and renamed into place
+// before the segments it replaces are deleted, and the file names say which segments each
+// file covers (<first>-<last>.jnl, in hex), so a reader listing the directory can tell a
+// summary from what it replaces. A reader that finds a listed file gone lists again;
+// one that had it mapped already keeps reading the old contents.
+//
+//    JournalSet journal;
+//    journal_policy policy = journal_default_policy;
+//    policy.keep_ns = 7 * 86400 * 1000000000ULL;
+//    journal.open ("/var/lib/watcher/journal", policy);
+//
+//    JournalSetReader reader;
+//    reader.open ("/var/lib/watcher/journal");
+//    reader.query ("/srv/www", t1, t2, print);
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef JOURNALSET_H
+#define JOURNALSET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "journal.h"
+
+#define JOURNAL_EVENT_MODIFY    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)
+#define JOURNAL_EVENT_CREATE    (IN_CREATE | IN_MOVED_TO)
+#define JOURNAL_EVENT_DELETE    (IN_DELETE | IN_MOVED_FROM)
+
+struct journal_policy {
+    uint32_t segment_blocks;    // segment size limit, in 64 kB blocks
+    uint64_t segment_ns;        // segment time limit, 0: none
+    uint64_t compact_after_ns;  // compact closed segments older than this, 0: never
+    uint64_t keep_ns;           // delete segments older than this, 0: keep
+    uint64_t keep_bytes;        // delete the oldest segments past this disk use, 0: no limit
+};
+
+// 16 MB or 10 minutes a segment, compacted after an hour, kept a day.
+static const journal_policy journal_default_policy = {
+    256, 600 * 1000000000ULL, 3600 * 1000000000ULL, 86400 * 1000000000ULL, 0
+};
+
+struct journal_segment {
+    uint64_t low, high;         // sequence numbers of the segments covered
+    uint64_t first, last;       // times
+    uint64_t bytes;             // on disk
+    bool summary;
+};
+
+static inline std::string journal_segment_name (const std::string &dir, uint64_t low, uint64_t high)
+{
+    char name[64];
+    snprintf (name, sizeof (name), "/%016llx-%016llx.jnl", (unsigned long long) low, (unsigned long long) high);
+    return dir + name;
+}
+
+struct by_range {
+    bool operator() (const journal_segment &a, const journal_segment &b) const {
+        return a.low != b.low ? a.low < b.low : a.high > b.high;
+    }
+};
+
+// The segments in dir, oldest first, leaving out any covered by another (a summary renamed
+// into place before the segments it replaces are gone), which go to covered if given.
+static inline bool journal_list (const std::string &dir, std::vector<journal_segment> &out,
+                                 std::vector<journal_segment> *covered = NULL)
+{
+    DIR *d = opendir (dir.c_str());
+    if (!d)
+        return false;
+    std::vector<journal_segment> all;
+    while (struct dirent *de = readdir (d)) {
+        unsigned long long low, high;
+        char tail[8];
+        if (sscanf (de->d_name, "%16llx-%16llx%7s", &low, &high, tail) != 3 || strcmp (tail, ".jnl"))
+            continue;
+        journal_segment s = {low, high, 0, 0, 0, low != high};
+        all.push_back (s);
+    }
+    closedir (d);
+    // Widest first among equal starts, so a covered segment follows its cover.
+    std::sort (all.begin(), all.end(), by_range());
+    out.clear();
+    if (covered)
+        covered->clear();
+    for (size_t i = 0; i < all.size(); i++) {
+        if (out.empty() || all[i].low > out.back().high)
+            out.push_back (all[i]);
+        else if (covered)
+            covered->push_back (all[i]);
+    }
+    return true;
+}
+
+// Net changes of records (in time order): which of them to keep.
+static inline void journal_net_changes (const std::vector<const journal_record *> &records, std::vector<bool> &keep)
+{
+    struct state {
+        long create, modify;    // index of the pending create and last modify, -1: none
+    };
+    std::unordered_map<std::string, state> paths;
+    keep.assign (records.size(), true);
+    for (size_t i = 0; i < records.size(); i++) {
+        const journal_record *r = records[i];
+        if (r->mask & IN_Q_OVERFLOW) {
+            // Anything may have been lost here: nothing pairs across it.
+            paths.clear();
+            continue;
+        }
+        std::string path (r->path, r->len);
+        std::unordered_map<std::string, state>::iterator p = paths.find (path);
+        if (p == paths.end()) {
+            state s = {-1, -1};
+            p = paths.insert (std::make_pair (path, s)).first;
+        }
+        if (r->mask & JOURNAL_EVENT_CREATE) {
+            p->second.create = i;
+        } else if (r->mask & JOURNAL_EVENT_DELETE) {
+            if (p->second.modify >= 0)
+                keep[p->second.modify] = false;
+            if (p->second.create >= 0) {
+                keep[p->second.create] = false;
+                keep[i] = false;
+            }
+            paths.erase (p);
+        } else if (r->mask & JOURNAL_EVENT_MODIFY) {
+            if (p->second.modify >= 0)
+                keep[p->second.modify] = false;
+            p->second.modify = i;
+        }
+    }
+}
+
+struct journal_collect {
+    std::vector<const journal_record *> &records;
+    size_t &bytes;
+    journal_collect (std::vector<const journal_record *> &records, size_t &bytes) : records (records), bytes (bytes) {}
+    void operator() (const journal_record *r) {
+        records.push_back (r);
+        bytes += (sizeof (journal_record) + r->len + 7) & ~(size_t) 7;
+    }
+};
+
+// Merge the segments of dir into one summary covering them all.
+static inline bool journal_compact (const std::string &dir, const std::vector<journal_segment> &in,
+                                    journal_segment *out)
+{
+    std::vector<JournalReader> readers (in.size());
+    std::vector<const journal_record *> records;
+    size_t bytes = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        if (!readers[i].open (journal_segment_name (dir, in[i].low, in[i].high).c_str()))
+            return false;
+        readers[i].query ("", 0, UINT64_MAX, journal_collect (records, bytes));
+    }
+    std::vector<bool> keep;
+    journal_net_changes (records, keep);
+    // A block is only left for the next when the next record doesn't fit, so every block but
+    // the last is over half full, counting that record.
+    size_t usable = JOURNAL_BLOCK_SIZE - sizeof (journal_block);
+    uint32_t blocks = 2 * bytes / usable + 2;
+    std::string tmp = dir + "/compacting.tmp";
+    JournalWriter w;
+    if (!w.create (tmp.c_str(), blocks, JOURNAL_SUMMARY))
+        return false;
+    for (size_t i = 0; i < records.size(); i++)
+        if (keep[i] && !w.copy (records[i])) {
+            w.close();
+            unlink (tmp.c_str());
+            return false;
+        }
+    journal_segment s = {in.front().low, in.back().high, 0, 0, 0, true};
+    *out = s;
+    w.seal();
+    return rename (tmp.c_str(), journal_segment_name (dir, s.low, s.high).c_str()) == 0;
+}
+
+// Writer side, owned by the watcher's thread; compaction and retention on their own thread.
+class JournalSet {
+    std::string dir;
+    journal_policy policy;
+    JournalWriter current;
+    uint64_t sequence;          // of the current segment
+    uint64_t started;           // time of its first record, 0: none yet
+    uint64_t newest;
+    std::vector<journal_segment> closed;        // oldest first, guarded by lock
+    pthread_t maintainer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    unsigned long written, dropped, rolled, compactions, compacted, expired;
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    static uint64_t disk_bytes (const std::string &path) {
+        struct stat st;
+        return stat (path.c_str(), &st) < 0 ? 0 : st.st_blocks * 512ULL;
+    }
+    bool start() {
+        started = 0;
+        return current.create (journal_segment_name (dir, sequence, sequence).c_str(), policy.segment_blocks);
+    }
+    // Close the current segment, hand it to the maintainer and start the next one.
+    bool roll() {
+        current.seal();
+        std::string name = journal_segment_name (dir, sequence, sequence);
+        JournalReader r;
+        journal_segment s = {sequence, sequence, 0, 0, disk_bytes (name), false};
+        if (r.open (name.c_str())) {
+            s.first = r.first();
+            s.last = r.last();
+        }
+        pthread_mutex_lock (&lock);
+        closed.push_back (s);
+        pthread_cond_signal (&wake);
+        pthread_mutex_unlock (&lock);
+        sequence++;
+        rolled++;
+        return start();
+    }
+
+    static void *maintain (void *arg) {
+        ((JournalSet *) arg)->maintain();
+        return NULL;
+    }
+    void maintain() {
+        pthread_mutex_lock (&lock);
+        while (running) {
+            struct timespec until;
+            clock_gettime (CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait (&wake, &lock, &until);
+            if (!running)
+                break;
+            uint64_t t = now();
+            // The run of raw segments old enough to compact, oldest first.
+            std::vector<journal_segment> old;
+            size_t from = 0;
+            while (from < closed.size() && closed[from].summary)
+                from++;
+            for (size_t i = from; policy.compact_after_ns && i < closed.size() && !closed[i].summary &&
+                 closed[i].last + policy.compact_after_ns < t; i++)
+                old.push_back (closed[i]);
+            if (!old.empty()) {
+                pthread_mutex_unlock (&lock);
+                journal_segment s;
+                bool done = journal_compact (dir, old, &s);
+                if (done) {
+                    s.first = old.front().first;
+                    s.last = old.back().last;
+                    s.bytes = disk_bytes (journal_segment_name (dir, s.low, s.high));
+                    // A single segment was replaced by the rename already.
+                    for (size_t i = 0; i < old.size() && old.size() > 1; i++)
+                        unlink (journal_segment_name (dir, old[i].low, old[i].high).c_str());
+                }
+                pthread_mutex_lock (&lock);
+                if (done) {
+                    closed.erase (closed.begin() + from, closed.begin() + from + old.size());
+                    closed.insert (closed.begin() + from, s);
+                    compactions++;
+                    compacted += old.size();
+                }
+            }
+            // Retention, oldest first. The current segment is never in closed.
+            uint64_t total = 0;
+            for (size_t i = 0; i < closed.size(); i++)
+                total += closed[i].bytes;
+            std::vector<journal_segment> gone;
+            while (!closed.empty() && ((policy.keep_ns && closed[0].last + policy.keep_ns < t) ||
+                                       (policy.keep_bytes && total > policy.keep_bytes))) {
+                total -= closed[0].bytes;
+                gone.push_back (closed[0]);
+                closed.erase (closed.begin());
+            }
+            expired += gone.size();
+            pthread_mutex_unlock (&lock);
+            for (size_t i = 0; i < gone.size(); i++)
+                unlink (journal_segment_name (dir, gone[i].low, gone[i].high).c_str());
+            pthread_mutex_lock (&lock);
+        }
+        pthread_mutex_unlock (&lock);
+    }
+
+public:
+    JournalSet() : sequence (0), started (0), newest (0), running (false), written (0), dropped (0),
+        rolled (0), compactions (0), compacted (0), expired (0) {
+        pthread_mutex_init (&lock, NULL);
+        pthread_cond_init (&wake, NULL);
+    }
+    ~JournalSet() { close(); }
+
+    // Open (creating if need be) the journal in directory path. Segments already there are
+    // kept, and subject to the policy; writing continues in a new one.
+    bool open (const char *path, const journal_policy &p = journal_default_policy) {
+        dir = path;
+        policy = p;
+        if (mkdir (path, 0755) < 0 && errno != EEXIST)
+            return false;
+        unlink ((dir + "/compacting.tmp").c_str());
+        // Segments a summary covers are left over from a compaction cut short between its
+        // rename and its unlinks: finish it.
+        std::vector<journal_segment> covered;
+        if (!journal_list (dir, closed, &covered))
+            return false;
+        for (size_t i = 0; i < covered.size(); i++)
+            unlink (journal_segment_name (dir, covered[i].low, covered[i].high).c_str());
+        for (size_t i = 0; i < closed.size(); i++) {
+            JournalReader r;
+            std::string name = journal_segment_name (dir, closed[i].low, closed[i].high);
+            if (r.open (name.c_str())) {
+                closed[i].first = r.first();
+                closed[i].last = r.last();
+                closed[i].summary = r.flags() & JOURNAL_SUMMARY;
+                newest = std::max (newest, closed[i].last);
+            }
+            closed[i].bytes = disk_bytes (name);
+            sequence = closed[i].high + 1;
+        }
+        if (!start())
+            return false;
+        running = true;
+        if (pthread_create (&maintainer, NULL, maintain, this)) {
+            running = false;
+            return false;
+        }
+        return true;
+    }
+    void close() {
+        if (!running)
+            return;
+        pthread_mutex_lock (&lock);
+        running = false;
+        pthread_cond_signal (&wake);
+        pthread_mutex_unlock (&lock);
+        pthread_join (maintainer, NULL);
+        current.seal();
+        if (!started)
+            unlink (journal_segment_name (dir, sequence, sequence).c_str());
+    }
+
+    bool append (uint64_t time, uint32_t mask, uint32_t cookie, const std::string &dir, const char *name) {
+        if (!running) {
+            dropped++;
+            return false;
+        }
+        // Monotonic across segments too, or queries would skip the wrong ones.
+        time = std::max (time, newest);
+        newest = time;
+        if (started && policy.segment_ns && time - started >= policy.segment_ns && !roll()) {
+            dropped++;
+            return false;
+        }
+        if (!current.append (time, mask, cookie, dir, name) &&
+            (!current.full() || !roll() || !current.append (time, mask, cookie, dir, name))) {
+            dropped++;
+            return false;
+        }
+        if (!started)
+            started = time;
+        written++;
+        return true;
+    }
+
+    void stats() {
+        pthread_mutex_lock (&lock);
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < closed.size(); i++)
+            bytes += closed[i].bytes;
+        printf ("journal: %lu events, %lu dropped; %lu segments rolled, %zu closed (%.1f MB), "
+                "%lu compactions of %lu segments, %lu expired\n", written, dropped, rolled, closed.size(),
+                bytes / 1048576.0, compactions, compacted, expired);
+        pthread_mutex_unlock (&lock);
+    }
+};
+
+// Query side, in any process: the segments of a journal directory.
+class JournalSetReader {
+    std::string dir;
+    std::vector<journal_segment> segments;
+    std::vector<JournalReader *> readers;
+
+    void clear() {
+        for (size_t i = 0; i < readers.size(); i++)
+            delete readers[i];
+        readers.clear();
+    }
+public:
+    unsigned long scanned, skipped;     // blocks read, blocks ruled out by their filter
+    unsigned long segments_skipped;     // ruled out by their time range
+
+    JournalSetReader() : scanned (0), skipped (0), segments_skipped (0) {}
+    ~JournalSetReader() { clear(); }
+
+    // Map the segments there are now. Later segments need another open().
+    bool open (const char *path) {
+        dir = path;
+        for (int attempt = 0; attempt < 100; attempt++) {
+            clear();
+            if (!journal_list (dir, segments))
+                return false;
+            bool raced = false;
+            for (size_t i = 0; i < segments.size() && !raced; i++) {
+                readers.push_back (new JournalReader);
+                if (!readers.back()->open (journal_segment_name (dir, segments[i].low, segments[i].high).c_str()))
+                    raced = errno == ENOENT;
+            }
+            if (!raced)
+                return true;
+        }
+        errno = EAGAIN;
+        return false;
+    }
+
+    // As JournalReader::query, over all segments. Summaries report net changes only.
+    template <class Found>
+    size_t query (const std::string &prefix, uint64_t from, uint64_t to, Found found) {
+        size_t matches = 0;
+        for (size_t i = 0; i < readers.size(); i++) {
+            JournalReader &r = *readers[i];
+            if (!r.is_open())
+                continue;
+            uint64_t first = r.first(), last = r.last();
+            if (!first || last < from || first > to) {
+                segments_skipped++;
+                continue;
+            }
+            matches += r.query (prefix, from, to, found);
+            scanned += r.scanned;
+            skipped += r.skipped;
+            r.scanned = r.skipped = 0;
+        }
+        return matches;
+    }
+    size_t size() const { return readers.size(); }
+};
+
+// Sink policy for Watcher: journals every event it is given.
+struct JournalSink {
+    JournalSet journal;
+    void event (const std::string &dir, const struct inotify_event *event) {
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        journal.append (ts.tv_sec * 1000000000ULL + ts.tv_nsec, event->mask, event->cookie, dir, event->name);
+    }
+    void overflow() {
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        journal.append (ts.tv_sec * 1000000000ULL + ts.tv_nsec, IN_Q_OVERFLOW, 0, "", "");
+    }
+    void ready (const std::string &, int, int, int) {}
+    void stats() { journal.stats(); }
+};
+
+#endif
@@ -0,0 +1,150 @@
+//
+// File:   membudget.h
+//
+// One memory budget for the whole watcher. Queues, buffers, caches and indexes register with a
+// MemoryBudget; check() measures the process (RSS from /proc/self/statm) against a hard cap and,
+// when over it, applies pressure in order until the process fits again:
+//
+//    PRESSURE_DROP_CACHES      drop anything that can be rebuilt (path caches, lookup caches)
+//    PRESSURE_SHRINK_BUFFERS   give back buffer space beyond what is needed to keep up
+//    PRESSURE_SHED_LOAD        stop doing optional work (deliver less, aggregate coarser)
+//
+// Within a level, consumers are asked in priority order (lowest first). Once usage drops below
+// the low-water mark, consumers are told PRESSURE_NONE and may grow back.
+//
+// Components take part by offering two calls, the same way policies work in watcher.h:
+//
+//    size_t usage() const;                       bytes currently held
+//    size_t relieve (int level, size_t excess);  act on level, return bytes (estimated) freed
+//
+// and are registered through Budgeted<T>, which is the only virtual layer, and only runs when
+// the budget is checked, never per event.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+enum {
+    PRESSURE_NONE,
+    PRESSURE_DROP_CACHES,
+    PRESSURE_SHRINK_BUFFERS,
+    PRESSURE_SHED_LOAD,
+};
+
+class MemoryConsumer {
+public:
+    virtual ~MemoryConsumer() {}
+    virtual const char *name() const = 0;
+    virtual size_t usage() const = 0;
+    virtual size_t relieve (int level, size_t excess) = 0;
+};
+
+template <class T>
+class Budgeted : public MemoryConsumer {
+    T &t;
+    const char *label;
+public:
+    Budgeted (T &t, const char *label) : t (t), label (label) {}
+    const char *name() const { return label; }
+    size_t usage() const { return t.usage(); }
+    size_t relieve (int level, size_t excess) { return t.relieve (level, excess); }
+};
+
+class MemoryBudget {
+    struct entry {
+        MemoryConsumer *consumer;
+        int priority;
+        bool operator< (const entry &r) const { return priority < r.priority; }
+    };
+    std::vector<entry> consumers;
+    size_t cap;
+    size_t low_water;
+    int level;
+    int interval;
+    time_t last;
+public:
+    // cap: hard RSS limit in bytes (0: none). Pressure is released again below 90% of it.
+    // check() measures at most once every interval seconds.
+    explicit MemoryBudget (size_t cap = 0, int interval = 1)
+        : cap (cap), low_water (cap / 10 * 9), level (PRESSURE_NONE), interval (interval), last (0) {}
+
+    void set_cap (size_t bytes) {
+        cap = bytes;
+        low_water = cap / 10 * 9;
+    }
+    void add (MemoryConsumer *consumer, int priority) {
+        entry e = {consumer, priority};
+        consumers.insert (std::upper_bound (consumers.begin(), consumers.end(), e), e);
+    }
+    void remove (MemoryConsumer *consumer) {
+        for (size_t i = 0; i < consumers.size(); i++) {
+            if (consumers[i].consumer == consumer) {
+                consumers.erase (consumers.begin() + i);
+                break;
+            }
+        }
+    }
+
+    // Resident set size of this process in bytes, or 0 if it can't be read.
+    static size_t rss() {
+        FILE *f = fopen ("/proc/self/statm", "r");
+        unsigned long size, resident = 0;
+        if (f) {
+            if (fscanf (f, "%lu %lu", &size, &resident) != 2)
+                resident = 0;
+            fclose (f);
+        }
+        return resident * sysconf (_SC_PAGESIZE);
+    }
+    // What the registered components say they hold.
+    size_t accounted() const {
+        size_t total = 0;
+        for (size_t i = 0; i < consumers.size(); i++)
+            total += consumers[i].consumer->usage();
+        return total;
+    }
+    // The larger of RSS and the accounted total, so the budget still works where /proc isn't.
+    size_t used() const { return std::max (rss(), accounted()); }
+
+    // Compare usage with the cap and apply or release pressure. Returns the current level.
+    int check (bool force = false) {
+        time_t now = time (NULL);
+        if (!cap || (!force && now - last < interval))
+            return level;
+        last = now;
+        size_t use = used();
+        if (use > cap) {
+            for (int l = level ? level : PRESSURE_DROP_CACHES; l <= PRESSURE_SHED_LOAD && use > cap; l++) {
+                level = l;
+                size_t excess = use - cap;
+                for (size_t i = 0; i < consumers.size() && excess > 0; i++) {
+                    size_t freed = consumers[i].consumer->relieve (l, excess);
+                    excess = freed < excess ? excess - freed : 0;
+                }
+                use = used();
+            }
+        } else if (level != PRESSURE_NONE && use < low_water) {
+            level = PRESSURE_NONE;
+            for (size_t i = 0; i < consumers.size(); i++)
+                consumers[i].consumer->relieve (PRESSURE_NONE, 0);
+        }
+        return level;
+    }
+    int pressure() const { return level; }
+
+    void stats() const {
+        printf ("memory: rss=%zu accounted=%zu cap=%zu pressure=%d\n", rss(), accounted(), cap, level);
+        for (size_t i = 0; i < consumers.size(); i++)
+            printf ("  %-12s %zu\n", consumers[i].consumer->name(), consumers[i].consumer->usage());
+    }
+};
+
+#endif
@@ -0,0 +1,441 @@
+//
+// File:   merkle.h
+//
+// A digest of every watched directory's subtree, kept up to date event by event, so that
+//
+//    - "has anything under X changed since I saw digest D?" is one comparison, and
+//    - two mirrored trees are compared by descending only where their digests differ,
+//      in time proportional to the differences rather than to the trees.
+//
+// Each directory holds one hash per entry: for a file, its name and metadata (size, mtime and
+// mode; not the inode, which differs between mirrors) and, if contents is set, a hash of its
+// data; for a subdirectory, its name and that directory's digest. A directory's digest is the
+// sum of its entry hashes (two 64-bit lanes), so changing one entry is a subtract and an add,
+// whatever the size of the directory, and then the same again in each ancestor, up to the
+// root.
+//
+// MerkleSink keeps the tree for a Watcher. It wants file metadata with each event, which
+// EnrichSink (enrich.h) supplies in batches, and the storage to find directories by wd:
+//
+//    Watcher<InotifyBackend, Watch, AcceptAll, EnrichSink<MerkleSink> > w (MERKLE_EVENTS);
+//    w.sink().inner().storage = &w.storage();
+//
+// Digests follow only what the watches report, hence MERKLE_EVENTS: every event that changes
+// a name or the metadata.
+//
+// Directories are digested as the bootstrap walker reports them covered (children first, so
+// each sees its subdirectories' digests), and when they are created later. A directory moved
+// within the watched trees keeps its subtree: IN_MOVED_FROM takes it out of its parent, and
+// the IN_MOVED_TO with the same cookie, which the kernel queues right after it, puts it in the
+// new one (where the watcher has re-parented it too). Moved out of the trees (no IN_MOVED_TO
+// follows), it is dropped, as the watcher drops its watches; moved in from outside, it is
+// digested like a created one, from its first level.
+//
+// A queue overflow loses events without saying which, so every watched directory is digested
+// again. Directories that went unwatched meanwhile can't be, and then valid turns false: from
+// then on equal digests no longer prove that nothing changed, and callers must check it.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "watch.h"
+#include "enrich.h"
+
+#define MERKLE_EVENTS   (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE)
+
+struct merkle_digest {
+    uint64_t a, b;
+    bool operator== (const merkle_digest &r) const { return a == r.a && b == r.b; }
+    bool operator!= (const merkle_digest &r) const { return !(*this == r); }
+};
+
+class MerkleTree {
+    struct node {
+        int pd;                                         // -1 for a root
+        std::string name;
+        std::unordered_map<std::string, merkle_digest> entries;
+        std::unordered_map<std::string, int> subdirs;   // name -> wd
+        merkle_digest sum;
+    };
+    std::unordered_map<int, node> nodes;
+
+    static uint64_t mix (uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    static uint64_t bytes (uint64_t h, const void *p, size_t len) {
+        const unsigned char *c = (const unsigned char *) p;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ c[i]) * 1099511628211ULL;
+        return h;
+    }
+    static merkle_digest entry (const std::string &name, uint64_t kind, uint64_t x, uint64_t y, uint64_t z, uint64_t w) {
+        uint64_t h = bytes (14695981039346656037ULL, name.data(), name.size());
+        merkle_digest d = {mix (h ^ mix (kind ^ mix (x ^ mix (y ^ mix (z ^ mix (w)))))),
+                           mix (~h + mix (w ^ mix (z + mix (y ^ mix (x + mix (kind))))))};
+        return d;
+    }
+    static merkle_digest subdir (const std::string &name, const merkle_digest &d) {
+        return entry (name, 1, d.a, d.b, 0, 0);
+    }
+    // Put (or with NULL, remove) name's entry in n, keeping the sum.
+    static void put (node &n, const std::string &name, const merkle_digest *e) {
+        std::unordered_map<std::string, merkle_digest>::iterator ei = n.entries.find (name);
+        if (ei != n.entries.end()) {
+            n.sum.a -= ei->second.a;
+            n.sum.b -= ei->second.b;
+            if (e)
+                ei->second = *e;
+            else
+                n.entries.erase (ei);
+        } else if (e) {
+            n.entries[name] = *e;
+        }
+        if (e) {
+            n.sum.a += e->a;
+            n.sum.b += e->b;
+        }
+    }
+    // wd's digest changed: update its entry in each ancestor.
+    void propagate (int wd) {
+        for (;;) {
+            node &n = nodes[wd];
+            if (n.pd < 0)
+                return;
+            std::unordered_map<int, node>::iterator pi = nodes.find (n.pd);
+            if (pi == nodes.end())
+                return;
+            merkle_digest e = subdir (n.name, digest (n));
+            put (pi->second, n.name, &e);
+            wd = n.pd;
+        }
+    }
+    void drop (int wd) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return;
+        std::vector<int> below;
+        for (std::unordered_map<std::string, int>::iterator si = ni->second.subdirs.begin();
+             si != ni->second.subdirs.end(); si++)
+            below.push_back (si->second);
+        nodes.erase (ni);
+        for (size_t i = 0; i < below.size(); i++)
+            drop (below[i]);
+    }
+    static merkle_digest digest (const node &n) {
+        // Not the bare sum, which is linear in the entries: mixed, and with the count.
+        merkle_digest d = {mix (n.sum.a ^ mix (n.entries.size())), mix (n.sum.b + mix (~n.entries.size()))};
+        return d;
+    }
+    static uint64_t content (const std::string &path) {
+        int fd = open (path.c_str(), O_RDONLY | O_NOFOLLOW);
+        if (fd < 0)
+            return 0;
+        uint64_t h = 14695981039346656037ULL;
+        char buf[65536];
+        ssize_t n;
+        while ((n = read (fd, buf, sizeof (buf))) > 0)
+            h = bytes (h, buf, n);
+        close (fd);
+        return mix (h);
+    }
+
+public:
+    bool contents;              // hash file data too (reads every changed file)
+    unsigned long updates;      // entry changes, each propagated to the root
+
+    MerkleTree() : contents (false), updates (0) {}
+
+    // Make sure wd has a node, as pd's subdirectory name (pd -1 for a root).
+    void add (int wd, int pd, const std::string &name) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni != nodes.end() && ni->second.pd == pd && ni->second.name == name)
+            return;
+        if (ni != nodes.end())
+            drop (wd);
+        node &n = nodes[wd];
+        n.pd = pd;
+        n.name = name;
+        n.sum.a = n.sum.b = 0;
+        if (pd >= 0 && nodes.count (pd)) {
+            nodes[pd].subdirs[name] = wd;
+            propagate (wd);
+        }
+    }
+    bool has (int wd) const { return nodes.count (wd) != 0; }
+
+    // A file in wd changed (or appeared); info as enrich.h gives it.
+    void file (int wd, const std::string &name, const file_info &info, const std::string &path) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return;
+        merkle_digest e = entry (name, 0, info.size, info.mtime.tv_sec * 1000000000ULL + info.mtime.tv_nsec,
+                                 info.mode, contents ? content (path) : 0);
+        put (ni->second, name, &e);
+        updates++;
+        propagate (wd);
+    }
+    // An unwatched subdirectory name appeared in wd: it counts as empty.
+    void dir (int wd, const std::string &name) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return;
+        node empty;
+        empty.sum.a = empty.sum.b = 0;
+        merkle_digest e = subdir (name, digest (empty));
+        put (ni->second, name, &e);
+        updates++;
+        propagate (wd);
+    }
+    // Entry name of wd is gone (file or directory).
+    void erase (int wd, const std::string &name) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return;
+        std::unordered_map<std::string, int>::iterator si = ni->second.subdirs.find (name);
+        if (si != ni->second.subdirs.end()) {
+            int child = si->second;
+            ni->second.subdirs.erase (si);
+            drop (child);
+            ni = nodes.find (wd);
+        }
+        put (ni->second, name, NULL);
+        updates++;
+        propagate (wd);
+    }
+    // Take subdirectory name out of wd like erase(), but keep its subtree for attach(). Returns
+    // its wd, -1 if it has no node (the entry goes all the same).
+    int detach (int wd, const std::string &name) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return -1;
+        int child = -1;
+        std::unordered_map<std::string, int>::iterator si = ni->second.subdirs.find (name);
+        if (si != ni->second.subdirs.end()) {
+            child = si->second;
+            ni->second.subdirs.erase (si);
+            nodes[child].pd = -1;
+        }
+        put (ni->second, name, NULL);
+        updates++;
+        propagate (wd);
+        return child;
+    }
+    // Put a detached subtree back, as pd's subdirectory name (replacing whatever was there).
+    void attach (int child, int pd, const std::string &name) {
+        std::unordered_map<int, node>::iterator ci = nodes.find (child), pi = nodes.find (pd);
+        if (ci == nodes.end() || pi == nodes.end())
+            return;
+        std::unordered_map<std::string, int>::iterator si = pi->second.subdirs.find (name);
+        if (si != pi->second.subdirs.end() && si->second != child) {
+            int old = si->second;
+            pi->second.subdirs.erase (si);
+            drop (old);
+        }
+        node &c = nodes[child];
+        c.pd = pd;
+        c.name = name;
+        nodes[pd].subdirs[name] = child;
+        updates++;
+        propagate (child);
+    }
+    // Forget a detached subtree for good.
+    void discard (int child) { drop (child); }
+    // Digest what directory wd (at path) holds now. Subdirectories count with their current
+    // digests, or as empty if they haven't got a node yet. Returns how many had none.
+    size_t scan (int wd, const std::string &path) {
+        std::unordered_map<int, node>::iterator ni = nodes.find (wd);
+        if (ni == nodes.end())
+            return 0;
+        node &n = ni->second;
+        DIR *d = opendir (path.c_str());
+        if (!d)
+            return 0;
+        size_t missing = 0;
+        n.entries.clear();
+        n.sum.a = n.sum.b = 0;
+        while (struct dirent *de = readdir (d)) {
+            if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+                continue;
+            struct stat st;
+            if (fstatat (dirfd (d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            std::string name = de->d_name;
+            merkle_digest e;
+            if (S_ISDIR (st.st_mode)) {
+                std::unordered_map<std::string, int>::iterator si = n.subdirs.find (name);
+                std::unordered_map<int, node>::iterator ci = si == n.subdirs.end() ? nodes.end() : nodes.find (si->second);
+                node empty;
+                empty.sum.a = empty.sum.b = 0;
+                e = subdir (name, digest (ci == nodes.end() ? empty : ci->second));
+                missing += ci == nodes.end();
+            } else {
+                e = entry (name, 0, st.st_size, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+                           st.st_mode, contents ? content (path + "/" + name) : 0);
+            }
+            put (n, name, &e);
+        }
+        closedir (d);
+        propagate (wd);
+        return missing;
+    }
+
+    // The digest of wd's subtree; equal digests mean equal subtrees.
+    merkle_digest digest (int wd) const {
+        std::unordered_map<int, node>::const_iterator ni = nodes.find (wd);
+        if (ni == nodes.end()) {
+            merkle_digest none = {0, 0};
+            return none;
+        }
+        return digest (ni->second);
+    }
+    size_t size() const { return nodes.size(); }
+
+    // Compare subtree wa of a with wb of b (mirrors of each other), calling report (path,
+    // what) for each entry that differs: '+' only in b, '-' only in a, '~' in both but not
+    // the same. Only directories whose digests differ are looked into. Returns the number of
+    // directories compared.
+    template <class Report>
+    static size_t diff (const MerkleTree &a, int wa, const MerkleTree &b, int wb, const std::string &path, Report &report) {
+        std::unordered_map<int, node>::const_iterator ai = a.nodes.find (wa), bi = b.nodes.find (wb);
+        if (ai == a.nodes.end() || bi == b.nodes.end() || digest (ai->second) == digest (bi->second))
+            return 0;
+        const node &na = ai->second, &nb = bi->second;
+        size_t compared = 1;
+        for (std::unordered_map<std::string, merkle_digest>::const_iterator ei = na.entries.begin();
+             ei != na.entries.end(); ei++) {
+            std::unordered_map<std::string, merkle_digest>::const_iterator fi = nb.entries.find (ei->first);
+            if (fi == nb.entries.end()) {
+                report (path + "/" + ei->first, '-');
+                continue;
+            }
+            if (fi->second == ei->second)
+                continue;
+            std::unordered_map<std::string, int>::const_iterator sa = na.subdirs.find (ei->first),
+                sb = nb.subdirs.find (ei->first);
+            if (sa != na.subdirs.end() && sb != nb.subdirs.end())
+                compared += diff (a, sa->second, b, sb->second, path + "/" + ei->first, report);
+            else
+                report (path + "/" + ei->first, '~');
+        }
+        for (std::unordered_map<std::string, merkle_digest>::const_iterator fi = nb.entries.begin();
+             fi != nb.entries.end(); fi++)
+            if (!na.entries.count (fi->first))
+                report (path + "/" + fi->first, '+');
+        return compared;
+    }
+};
+
+// Sink policy (inside EnrichSink): keeps a MerkleTree of the watched directories.
+struct MerkleSink {
+    MerkleTree tree;
+    Watch *storage;
+    int moving;                 // detached by IN_MOVED_FROM, -1 if none
+    uint32_t cookie;            // ... and its cookie
+    bool valid;                 // false once an overflow lost directories the watcher never saw
+    unsigned long rescans;
+    MerkleSink() : storage (NULL), moving (-1), cookie (0), valid (true), rescans (0) {}
+
+    // A node for wd and, as needed, its ancestors.
+    void known (int wd) {
+        if (tree.has (wd) || !storage->has (wd))
+            return;
+        int pd = storage->parent (wd);
+        if (pd >= 0)
+            known (pd);
+        tree.add (wd, pd, storage->name (wd));
+    }
+    void event (const std::string &dir, const struct inotify_event *event, const file_info &info) {
+        if (!storage)
+            return;
+        // The directory detached last wasn't moved within the trees: it left them.
+        if (moving >= 0 && !(event->mask & IN_MOVED_TO && event->cookie == cookie)) {
+            tree.discard (moving);
+            moving = -1;
+        }
+        known (event->wd);
+        if (event->mask & IN_MOVED_FROM && event->mask & IN_ISDIR) {
+            moving = tree.detach (event->wd, event->name);
+            cookie = event->cookie;
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            tree.erase (event->wd, event->name);
+        } else if (event->mask & IN_ISDIR) {
+            if (event->mask & IN_MOVED_TO && moving >= 0) {
+                tree.attach (moving, event->wd, event->name);
+                moving = -1;
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                int wd = storage->child (event->wd, event->name);
+                if (wd >= 0) {
+                    tree.add (wd, event->wd, event->name);
+                    tree.scan (wd, dir + "/" + event->name);
+                } else {
+                    tree.dir (event->wd, event->name);
+                }
+            }
+        } else if (info.valid) {
+            tree.file (event->wd, event->name, info, dir + "/" + event->name);
+        }
+    }
+    // Events were lost, and nothing says which: digest every watched directory again, children
+    // first. A subdirectory without a watch (created meanwhile, the watcher learns of those by
+    // events only, or not walked yet) may hide anything, so finding one makes valid false.
+    void overflow() {
+        if (!storage)
+            return;
+        if (moving >= 0) {
+            tree.discard (moving);
+            moving = -1;
+        }
+        std::vector<int> wds, order;
+        storage->list (wds);
+        for (size_t i = 0; i < wds.size(); i++)
+            if (storage->parent (wds[i]) == -1)
+                storage->subtree (wds[i], order);
+        for (size_t i = order.size(); i-- > 0; ) {
+            known (order[i]);
+            if (tree.scan (order[i], storage->get (order[i])))
+                valid = false;
+        }
+        rescans++;
+    }
+    // A directory is fully watched: its subdirectories are, and were digested, already.
+    void ready (const std::string &path, int wd, int, int) {
+        if (!storage)
+            return;
+        known (wd);
+        tree.scan (wd, path);
+    }
+    void stats() {
+        std::vector<int> wds;
+        if (storage)
+            storage->list (wds);
+        for (size_t i = 0; i < wds.size(); i++)
+            if (storage->parent (wds[i]) == -1) {
+                merkle_digest d = tree.digest (wds[i]);
+                printf ("digest %s: %016llx%016llx\n", storage->name (wds[i]).c_str(),
+                        (unsigned long long) d.a, (unsigned long long) d.b);
+            }
+        printf ("merkle: %zu directories, %lu updates, %lu rescans%s\n", tree.size(), tree.updates, rescans,
+                valid ? "" : ", digests no longer valid (events lost)");
+    }
+};
+
+#endif
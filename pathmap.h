@@ -0,0 +1,367 @@
+//
+// File:   pathmap.h
+//
+// The Watch tree published read-only in shared memory, so other processes that receive raw
+// wd-based events (through dirtymap.h, a socket, a log) can turn wds into paths without
+// calling into the watcher. Like Watch itself, the segment holds (parent wd, name) per wd,
+// not full paths, so a renamed directory is one update however much is below it; readers
+// assemble the path by walking up the parents.
+//
+// The writer is the only one to modify the segment and guards each update with a seqlock:
+// the sequence number is odd while an update is in progress. Readers never block or write,
+// they copy what they need and retry if the sequence number changed meanwhile, so a reader
+// that is slow, stuck or dead has no effect on the watcher. The other way round, a writer that
+// dies mid-update leaves the sequence number odd for good: readers give up after
+// PATHMAP_MAX_RETRIES attempts (yielding the CPU after the first PATHMAP_SPINS) with EAGAIN.
+//
+// Segment layout (all little endian, naturally aligned):
+//
+//    header   magic, version, slots, arena size, sequence, entries, arena used
+//    slots    open-addressed hash table of {wd, pd, name offset, name length}
+//    arena    names, appended; compacted in place when it runs out
+//
+// SharedWatch is the Storage policy for Watcher that keeps the segment in step with Watch:
+//
+//    Watcher<InotifyBackend, SharedWatch> w;
+//    w.storage().publish ("/inotify-paths", 65536);
+//
+// and PathReader the reader side, in any process.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef PATHMAP_H
+#define PATHMAP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "watch.h"
+
+#define PATHMAP_MAGIC       0x70617468      // "path"
+#define PATHMAP_VERSION     1
+#define PATHMAP_EMPTY       -1
+#define PATHMAP_DELETED     -2
+#define PATHMAP_MAX_DEPTH   4096
+#define PATHMAP_SPINS       1024
+#define PATHMAP_MAX_RETRIES 100000
+
+struct pathmap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;         // power of two
+    uint32_t arena;         // bytes
+    uint32_t sequence;      // odd while the writer is updating
+    uint32_t entries;
+    uint32_t used;          // arena bytes used, live or not
+    uint32_t pad;
+};
+
+struct pathmap_slot {
+    int32_t wd;             // PATHMAP_EMPTY, PATHMAP_DELETED or a wd
+    int32_t pd;
+    uint32_t name;          // arena offset
+    uint32_t len;
+};
+
+// Maps a segment created by PathMap. Base of both the writer and the reader.
+class PathSegment {
+protected:
+    void *base;
+    size_t size;
+    pathmap_header *header;
+    pathmap_slot *slots;
+    char *arena;
+
+    static size_t bytes (uint32_t slots, uint32_t arena) {
+        return sizeof (pathmap_header) + slots * sizeof (pathmap_slot) + arena;
+    }
+    static uint32_t hash (int wd) { return (uint32_t) wd * 2654435761u; }
+    bool map (int fd, bool writable) {
+        int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+        base = mmap (NULL, size, prot, MAP_SHARED, fd, 0);
+        close (fd);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            return false;
+        }
+        header = (pathmap_header *) base;
+        slots = (pathmap_slot *) (header + 1);
+        arena = (char *) (slots + header->slots);
+        return true;
+    }
+    // Slot holding wd, or -1. Readers call this inside a read section, so it must stop even
+    // on a torn table.
+    long find (int wd) const {
+        uint32_t mask = header->slots - 1;
+        for (uint32_t i = hash (wd) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+            int32_t w = __atomic_load_n (&slots[i].wd, __ATOMIC_RELAXED);
+            if (w == wd)
+                return i;
+            if (w == PATHMAP_EMPTY)
+                return -1;
+        }
+        return -1;
+    }
+public:
+    PathSegment() : base (NULL), size (0), header (NULL), slots (NULL), arena (NULL) {}
+    ~PathSegment() {
+        if (base)
+            munmap (base, size);
+    }
+};
+
+// Writer side, owned by the watcher.
+class PathMap : public PathSegment {
+    std::string name;
+    uint32_t deleted;
+
+    void begin() {
+        __atomic_store_n (&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_RELEASE);
+    }
+    void end() {
+        __atomic_store_n (&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+    }
+    // Rebuild the table and arena without deleted entries and dead names. Called inside an
+    // update, so readers retry rather than see it half done.
+    void compact() {
+        std::vector<pathmap_slot> live;
+        std::string names;
+        for (uint32_t i = 0; i < header->slots; i++) {
+            if (slots[i].wd < 0)
+                continue;
+            pathmap_slot s = slots[i];
+            s.name = names.size();
+            names.append (arena + slots[i].name, slots[i].len);
+            live.push_back (s);
+        }
+        memset (slots, 0xff, header->slots * sizeof (pathmap_slot));
+        memcpy (arena, names.data(), names.size());
+        header->used = names.size();
+        for (size_t i = 0; i < live.size(); i++)
+            slots[free_slot (live[i].wd)] = live[i];
+        deleted = 0;
+    }
+    uint32_t free_slot (int wd) {
+        uint32_t mask = header->slots - 1, i = hash (wd) & mask;
+        while (slots[i].wd >= 0 && slots[i].wd != wd)
+            i = (i + 1) & mask;
+        return i;
+    }
+public:
+    PathMap() : deleted (0) {}
+    ~PathMap() {
+        if (!name.empty())
+            shm_unlink (name.c_str());
+    }
+
+    // Create (or replace) the shared memory segment /name for up to entries directories, with
+    // arena_bytes for their names (default: 32 bytes each).
+    bool create (const char *shm_name, uint32_t entries, uint32_t arena_bytes = 0) {
+        uint32_t n = 64;
+        while (n < entries * 2)
+            n *= 2;
+        if (!arena_bytes)
+            arena_bytes = entries * 32;
+        int fd = shm_open (shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        size = bytes (n, arena_bytes);
+        if (ftruncate (fd, size) < 0) {
+            close (fd);
+            return false;
+        }
+        name = shm_name;
+        pathmap_header h = {PATHMAP_MAGIC, PATHMAP_VERSION, n, arena_bytes, 0, 0, 0, 0};
+        if (pwrite (fd, &h, sizeof (h), 0) != (ssize_t) sizeof (h)) {
+            close (fd);
+            return false;
+        }
+        if (!map (fd, true))
+            return false;
+        memset (slots, 0xff, n * sizeof (pathmap_slot));
+        return true;
+    }
+    bool published() const { return base != NULL; }
+
+    // Publish wd as name in directory pd (-1 for a root). False if the table or the arena is
+    // full even after compaction; wd is then unknown to readers.
+    bool set (int wd, int pd, const std::string &dir) {
+        if (!base)
+            return false;
+        begin();
+        long at = find (wd);
+        bool fits = at >= 0 || (header->entries + deleted + 1) * 4 <= header->slots * 3;
+        if (!fits && deleted) {
+            compact();
+            fits = (header->entries + 1) * 4 <= header->slots * 3;
+        }
+        if (fits && header->used + dir.size() > header->arena) {
+            compact();
+            at = find (wd);
+        }
+        if (!fits || header->used + dir.size() > header->arena) {
+            end();
+            return false;
+        }
+        pathmap_slot s = {wd, pd, header->used, (uint32_t) dir.size()};
+        memcpy (arena + header->used, dir.data(), dir.size());
+        header->used += dir.size();
+        if (at < 0) {
+            at = free_slot (wd);
+            if (slots[at].wd == PATHMAP_DELETED)
+                deleted--;
+            header->entries++;
+        }
+        slots[at] = s;
+        end();
+        return true;
+    }
+    void erase (int wd) {
+        if (!base)
+            return;
+        long at = find (wd);
+        if (at < 0)
+            return;
+        begin();
+        slots[at].wd = PATHMAP_DELETED;
+        header->entries--;
+        deleted++;
+        end();
+    }
+    void clear() {
+        if (!base)
+            return;
+        begin();
+        memset (slots, 0xff, header->slots * sizeof (pathmap_slot));
+        header->entries = header->used = 0;
+        deleted = 0;
+        end();
+    }
+};
+
+// Reader side, in any process. Maps the segment read-only.
+class PathReader : public PathSegment {
+public:
+    unsigned long retries;
+    PathReader() : retries (0) {}
+
+    bool open (const char *shm_name) {
+        int fd = shm_open (shm_name, O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        pathmap_header h;
+        if (fstat (fd, &st) < 0 || pread (fd, &h, sizeof (h), 0) != (ssize_t) sizeof (h) ||
+            h.magic != PATHMAP_MAGIC || h.version != PATHMAP_VERSION || (h.slots & (h.slots - 1)) ||
+            (size_t) st.st_size < bytes (h.slots, h.arena)) {
+            close (fd);
+            errno = EINVAL;
+            return false;
+        }
+        size = bytes (h.slots, h.arena);
+        return map (fd, false);
+    }
+
+    // The path of wd as the watcher knows it. False with errno ENOENT if wd isn't published
+    // (or one of its parents isn't, e.g. while a subtree is being deleted), EAGAIN if no
+    // consistent copy could be had (the writer is stuck or died mid-update).
+    bool path (int wd, std::string &out) {
+        for (int attempt = 0; ; attempt++) {
+            if (attempt >= PATHMAP_MAX_RETRIES) {
+                errno = EAGAIN;
+                return false;
+            }
+            if (attempt >= PATHMAP_SPINS)
+                sched_yield();
+            uint32_t seq = __atomic_load_n (&header->sequence, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                retries++;
+                continue;
+            }
+            std::string p;
+            bool found = true;
+            int d = wd;
+            for (int depth = 0; d != -1 && found; depth++) {
+                long at = depth < PATHMAP_MAX_DEPTH ? find (d) : -1;
+                if (at < 0) {
+                    found = false;
+                    break;
+                }
+                pathmap_slot s = slots[at];
+                if (s.name > header->arena || s.len > header->arena - s.name) {
+                    found = false;
+                    break;
+                }
+                std::string component (arena + s.name, s.len);
+                p = p.empty() ? component : component + "/" + p;
+                d = s.pd;
+            }
+            __atomic_thread_fence (__ATOMIC_ACQUIRE);
+            if (__atomic_load_n (&header->sequence, __ATOMIC_RELAXED) != seq) {
+                retries++;
+                continue;
+            }
+            if (found)
+                out.swap (p);
+            else
+                errno = ENOENT;
+            return found;
+        }
+    }
+    uint32_t sequence() const { return __atomic_load_n (&header->sequence, __ATOMIC_ACQUIRE); }
+    uint32_t entries() const { return __atomic_load_n (&header->entries, __ATOMIC_RELAXED); }
+};
+
+// Storage policy for Watcher: Watch, plus the segment kept up to date.
+class SharedWatch : public Watch {
+    PathMap map;
+    unsigned long unpublished;
+public:
+    SharedWatch() : unpublished (0) {}
+
+    // Start publishing, including what is already watched.
+    bool publish (const char *shm_name, uint32_t entries, uint32_t arena_bytes = 0) {
+        if (!map.create (shm_name, entries, arena_bytes))
+            return false;
+        std::vector<int> wds;
+        list (wds);
+        for (size_t i = 0; i < wds.size(); i++)
+            if (!map.set (wds[i], parent (wds[i]), name (wds[i])))
+                unpublished++;
+        return true;
+    }
+    void insert (int pd, const std::string &name, int wd) {
+        Watch::insert (pd, name, wd);
+        if (map.published() && !map.set (wd, pd, name))
+            unpublished++;
+    }
+    std::string erase (int pd, const std::string &name, int *wd) {
+        std::string dir = Watch::erase (pd, name, wd);
+        if (*wd >= 0)
+            map.erase (*wd);
+        return dir;
+    }
+    template <class Backend>
+    void cleanup (Backend &in) {
+        Watch::cleanup (in);
+        map.clear();
+    }
+    void stats() {
+        Watch::stats();
+        if (unpublished)
+            std::cout << unpublished << " directories did not fit the shared path map" << std::endl;
+    }
+};
+
+#endif
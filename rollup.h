@@ -0,0 +1,214 @@
+//
+// File:   rollup.h
+//
+// Periodic rollup: instead of shipping every event, count them per (directory prefix, event
+// type) and emit one summary line per active prefix each interval. Output volume then grows
+// with the number of active directories, not with the number of events.
+//
+// Counting happens in per-thread shards (one per thread that calls event()), so the hot path
+// never takes a shared lock; shards are merged when the interval ends. Shards are swapped out
+// under a short per-shard lock, so a flush never blocks counting for longer than a map swap.
+//
+// RollupSink plugs into Watcher (watcher.h) as a Sink policy:
+//
+//    Watcher<InotifyBackend, Watch, AcceptAll, RollupSink> w;
+//    w.sink().configure (2, 10, emit_line);      // depth 2 below each root, every 10 seconds
+//    w.sink().rollup.add_root (root);
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "membudget.h"
+
+// Short names for the event types rolled up. Events with several bits count once per bit.
+static const struct { uint32_t bit; const char *name; } rollup_types[] = {
+    {IN_CREATE, "create"}, {IN_DELETE, "delete"}, {IN_MODIFY, "modify"}, {IN_ATTRIB, "attrib"},
+    {IN_CLOSE_WRITE, "close_write"}, {IN_MOVED_FROM, "moved_from"}, {IN_MOVED_TO, "moved_to"},
+    {IN_DELETE_SELF, "delete_self"}, {IN_MOVE_SELF, "move_self"}, {IN_Q_OVERFLOW, "overflow"},
+};
+#define ROLLUP_TYPES (sizeof (rollup_types) / sizeof (rollup_types[0]))
+
+class Rollup {
+public:
+    struct counts {
+        uint64_t n[ROLLUP_TYPES];
+        counts() { for (size_t i = 0; i < ROLLUP_TYPES; i++) n[i] = 0; }
+    };
+    typedef std::map<std::string, counts> table;
+
+private:
+    struct shard {
+        pthread_mutex_t lock;
+        table counts;
+        shard() { pthread_mutex_init (&lock, NULL); }
+        ~shard() { pthread_mutex_destroy (&lock); }
+    };
+    int depth;
+    int configured;
+    pthread_key_t key;
+    pthread_mutex_t shards_lock;
+    std::vector<shard *> shards;
+    std::vector<std::string> roots;
+
+public:
+    // depth: how many path components below the root make up a prefix (0: the root itself).
+    explicit Rollup (int depth = 1) : depth (depth), configured (depth) {
+        pthread_key_create (&key, NULL);
+        pthread_mutex_init (&shards_lock, NULL);
+    }
+    ~Rollup() {
+        for (size_t i = 0; i < shards.size(); i++)
+            delete shards[i];
+        pthread_key_delete (key);
+        pthread_mutex_destroy (&shards_lock);
+    }
+    void set_depth (int d) { depth = configured = d; }
+    // Prefixes are counted relative to the longest matching root; other paths are cut at depth
+    // components from the start.
+    void add_root (const std::string &root) { roots.push_back (root); }
+
+    // Count an event in dir. Only touches the calling thread's shard.
+    void event (const std::string &dir, uint32_t mask) {
+        shard *s = local();
+        std::string p = prefix (dir);
+        pthread_mutex_lock (&s->lock);
+        counts &c = s->counts[p];
+        for (size_t i = 0; i < ROLLUP_TYPES; i++)
+            if (mask & rollup_types[i].bit)
+                c.n[i]++;
+        pthread_mutex_unlock (&s->lock);
+    }
+
+    // End the interval: take every shard's counts and merge them into one table.
+    table flush() {
+        table merged;
+        pthread_mutex_lock (&shards_lock);
+        for (size_t i = 0; i < shards.size(); i++) {
+            table mine;
+            pthread_mutex_lock (&shards[i]->lock);
+            mine.swap (shards[i]->counts);
+            pthread_mutex_unlock (&shards[i]->lock);
+            for (table::iterator ti = mine.begin(); ti != mine.end(); ti++) {
+                counts &c = merged[ti->first];
+                for (size_t t = 0; t < ROLLUP_TYPES; t++)
+                    c.n[t] += ti->second.n[t];
+            }
+        }
+        pthread_mutex_unlock (&shards_lock);
+        return merged;
+    }
+
+    // Memory budget hooks (membudget.h): on reaching PRESSURE_SHED_LOAD prefixes are cut one
+    // level shallower, once, so fewer distinct rows are kept; PRESSURE_NONE goes back to the
+    // configured depth.
+    size_t usage() {
+        size_t rows = 0;
+        pthread_mutex_lock (&shards_lock);
+        for (size_t i = 0; i < shards.size(); i++) {
+            pthread_mutex_lock (&shards[i]->lock);
+            rows += shards[i]->counts.size();
+            pthread_mutex_unlock (&shards[i]->lock);
+        }
+        pthread_mutex_unlock (&shards_lock);
+        return rows * (sizeof (counts) + 96);
+    }
+    size_t relieve (int level, size_t) {
+        if (level == PRESSURE_NONE)
+            depth = configured;
+        else if (level == PRESSURE_SHED_LOAD && depth == configured && depth > 0)
+            depth--;
+        return 0;
+    }
+
+    // One line per prefix with non-zero counts, e.g. "1373990400 ./tmp/a create=12 delete=3".
+    static void print (FILE *out, time_t when, const table &t) {
+        for (table::const_iterator ti = t.begin(); ti != t.end(); ti++) {
+            fprintf (out, "%ld %s", (long) when, ti->first.c_str());
+            for (size_t i = 0; i < ROLLUP_TYPES; i++)
+                if (ti->second.n[i])
+                    fprintf (out, " %s=%llu", rollup_types[i].name, (unsigned long long) ti->second.n[i]);
+            fprintf (out, "\n");
+        }
+    }
+
+private:
+    shard *local() {
+        shard *s = (shard *) pthread_getspecific (key);
+        if (!s) {
+            s = new shard;
+            pthread_setspecific (key, s);
+            pthread_mutex_lock (&shards_lock);
+            shards.push_back (s);
+            pthread_mutex_unlock (&shards_lock);
+        }
+        return s;
+    }
+
+    std::string prefix (const std::string &dir) const {
+        size_t start = 0;
+        for (size_t i = 0; i < roots.size(); i++) {
+            const std::string &r = roots[i];
+            if (r.size() > start && dir.compare (0, r.size(), r) == 0 &&
+                (dir.size() == r.size() || dir[r.size()] == '/'))
+                start = r.size();
+        }
+        size_t end = start;
+        for (int d = 0; d < depth && end < dir.size(); d++) {
+            end = dir.find ('/', end + 1);
+            if (end == std::string::npos)
+                return dir;
+        }
+        return dir.substr (0, end);
+    }
+};
+
+// Sink policy for Watcher: counts into a Rollup and, when an event arrives after the interval
+// has passed, hands the merged table to emit (printing to stdout by default). Call tick() from a
+// timer as well if intervals must close while the tree is quiet.
+struct RollupSink {
+    typedef void (*emit_fn) (time_t when, const Rollup::table &t);
+    Rollup rollup;
+    int interval;
+    time_t next;
+    emit_fn emit;
+
+    RollupSink() : interval (10), next (0), emit (print_stdout) {}
+    void configure (int depth, int seconds, emit_fn fn = print_stdout) {
+        rollup.set_depth (depth);
+        interval = seconds;
+        emit = fn;
+    }
+    void event (const std::string &dir, const struct inotify_event *event) {
+        rollup.event (dir, event->mask);
+        tick();
+    }
+    void overflow() { rollup.event ("", IN_Q_OVERFLOW); }
+    void ready (const std::string &, int, int, int) {}
+    void stats() { tick (true); }
+    void tick (bool force = false) {
+        time_t now = time (NULL);
+        if (!next)
+            next = now + interval;
+        if (!force && now < next)
+            return;
+        Rollup::table t = rollup.flush();
+        if (!t.empty())
+            emit (now, t);
+        next = now + interval;
+    }
+    static void print_stdout (time_t when, const Rollup::table &t) { Rollup::print (stdout, when, t); }
+};
+
+#endif
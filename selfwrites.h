@@ -0,0 +1,152 @@
+//
+// File:   selfwrites.h
+//
+// Feedback-loop suppression. When the watcher's own output (a journal, a mirror, a log) lives
+// inside a watched root, every write it makes is reported back to it, handling that event
+// writes again, and a single event can turn into a storm. SelfWrites holds the files and
+// directories the watcher writes, tagged by (dev, inode), and Watcher drops their events first
+// thing in dispatch, before any bookkeeping, filter or sink sees them.
+//
+// Stat'ing every event to compare inodes would cost a syscall per event, so tags are resolved
+// once into what events carry: (parent wd, name) for the tagged entry itself, and the wd of a
+// tagged directory and of every watched directory below it for everything inside them. The
+// check per event is then one or two set lookups, and none at all while nothing is tagged.
+//
+// Resolution needs the parent directory to be watched. The watcher calls resolve() on each
+// poll, but it only does work when the watch storage changed since the last time (its
+// generation went up) or a tag was added: tags that can't be resolved yet, e.g. a log outside
+// every root, cost nothing while the tree stands still, and tagged directories pick up the
+// subdirectories watched below them. A tag whose path is gone or no longer has its (dev,
+// inode) (the file was replaced) is dropped; tag it again to cover the new file. So are
+// resolved tags whose directory, or parent directory, is no longer watched.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef SELFWRITES_H
+#define SELFWRITES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <set>
+#include <map>
+#include <vector>
+
+class SelfWrites {
+    struct tag {
+        dev_t dev;
+        ino_t ino;
+        bool dir;
+        std::string path;       // real path at tagging time
+    };
+    typedef std::pair<int, std::string> name_key;   // (parent wd, name)
+    std::vector<tag> pending;
+    std::set<name_key> names;                       // of tagged entries
+    std::map<int, name_key> tagged;                 // wds of tagged directories, and their names
+    std::set<int> dirs;                             // ... and of every directory below them
+    unsigned long seen;                             // storage generation at the last resolve()
+    bool changed;                                   // tags added since
+    unsigned long dropped;
+public:
+    SelfWrites() : seen (0), changed (false), dropped (0) {}
+
+    // Tag a file or directory by path. Returns false if it doesn't exist.
+    bool tag_path (const char *path) {
+        char real[PATH_MAX];
+        struct stat st;
+        if (!realpath (path, real) || lstat (real, &st) < 0)
+            return false;
+        struct tag t = {st.st_dev, st.st_ino, S_ISDIR (st.st_mode), real};
+        pending.push_back (t);
+        changed = true;
+        return true;
+    }
+    // Tag whatever an open fd refers to, e.g. the log a sink writes to.
+    bool tag_fd (int fd) {
+        char link[64], real[PATH_MAX];
+        snprintf (link, sizeof (link), "/proc/self/fd/%d", fd);
+        ssize_t n = readlink (link, real, sizeof (real) - 1);
+        if (n < 0)
+            return false;
+        real[n] = '\0';
+        struct stat st;
+        if (fstat (fd, &st) < 0)
+            return false;
+        struct tag t = {st.st_dev, st.st_ino, S_ISDIR (st.st_mode), real};
+        pending.push_back (t);
+        changed = true;
+        return true;
+    }
+
+    bool unresolved() const { return !pending.empty(); }
+    bool empty() const { return pending.empty() && names.empty() && dirs.empty(); }
+
+    // Turn pending tags into (wd, name) and wd keys using the watch storage, which needs
+    // generation(), has (wd), lookup (path) and subtree (wd, wds), take in directories watched
+    // below tagged ones since, and drop what is no longer watched. Does nothing unless the
+    // storage or the tags changed. Returns the number of tags still pending.
+    template <class Storage>
+    size_t resolve (Storage &storage) {
+        if (!changed && storage.generation() == seen)
+            return pending.size();
+        seen = storage.generation();
+        changed = false;
+        for (std::set<name_key>::iterator ni = names.begin(); ni != names.end(); ) {
+            if (storage.has (ni->first))
+                ni++;
+            else
+                names.erase (ni++);
+        }
+        for (std::map<int, name_key>::iterator ti = tagged.begin(); ti != tagged.end(); ) {
+            if (storage.has (ti->first)) {
+                ti++;
+            } else {
+                names.erase (ti->second);
+                tagged.erase (ti++);
+            }
+        }
+        for (size_t i = 0; i < pending.size(); ) {
+            const tag &t = pending[i];
+            struct stat st;
+            if (lstat (t.path.c_str(), &st) < 0 || st.st_dev != t.dev || st.st_ino != t.ino) {
+                pending.erase (pending.begin() + i);
+                continue;
+            }
+            size_t slash = t.path.rfind ('/');
+            int pd = storage.lookup (slash ? t.path.substr (0, slash) : "/");
+            int wd = t.dir ? storage.lookup (t.path) : -1;
+            if (pd < 0 || (t.dir && wd < 0)) {
+                i++;
+                continue;
+            }
+            names.insert (std::make_pair (pd, t.path.substr (slash + 1)));
+            if (t.dir)
+                tagged[wd] = std::make_pair (pd, t.path.substr (slash + 1));
+            pending.erase (pending.begin() + i);
+        }
+        std::vector<int> below;
+        dirs.clear();
+        for (std::map<int, name_key>::iterator ti = tagged.begin(); ti != tagged.end(); ti++) {
+            below.clear();
+            storage.subtree (ti->first, below);
+            dirs.insert (below.begin(), below.end());
+        }
+        return pending.size();
+    }
+
+    // Is this event about one of our own files or directories?
+    bool drop (int wd, const char *name) {
+        if (dirs.count (wd) || (name[0] && names.count (std::make_pair (wd, std::string (name))))) {
+            dropped++;
+            return true;
+        }
+        return false;
+    }
+    unsigned long count() const { return dropped; }
+};
+
+#endif
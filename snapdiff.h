@@ -0,0 +1,264 @@
+//
+// File:   snapdiff.h
+//
+// Directory snapshot diff: "old listing vs new listing" as added, removed and changed
+// entries. PollingBackend rescans with it; anything else that compares listings (recovery
+// after an overflow, reconciling a tree after a restart) can share it.
+//
+// A Snapshot holds one directory as parallel sorted arrays of name hash, inode and stamp
+// (mtime in ns mixed with the size, so a same-mtime truncation still shows). Two snapshots
+// are merged in hash order, and since most of a directory doesn't change between two scans,
+// most of the merge is long runs where both sides are equal. Those runs are compared 4
+// entries at a time with AVX2 or 2 at a time with SSE2, and only the entries around a
+// difference take the scalar merge step. The implementation is picked at run time from what
+// the CPU supports; the scalar one works everywhere.
+//
+//    Snapshot before, after;
+//    before.list ("/srv/www");
+//    ...
+//    after.list ("/srv/www");
+//    SnapshotDiff diff;
+//    snapshot_diff (before, after, diff);
+//    for (size_t i = 0; i < diff.added.size(); i++)
+//        printf ("+ %s\n", after.name (diff.added[i]));
+//
+// Names are identified by a 64-bit hash: two names of one directory colliding would be
+// reported as a replacement of one by the other.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef SNAPDIFF_H
+#define SNAPDIFF_H
+
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#define SNAPDIFF_X86 1
+#endif
+
+enum snapdiff_impl { SNAPDIFF_AUTO, SNAPDIFF_SCALAR, SNAPDIFF_SSE2, SNAPDIFF_AVX2 };
+
+class Snapshot {
+    std::string arena;                  // names, NUL terminated
+    std::vector<uint32_t> names;        // arena offsets
+
+    struct by_hash {
+        const std::vector<uint64_t> &h;
+        by_hash (const std::vector<uint64_t> &h) : h (h) {}
+        bool operator() (uint32_t a, uint32_t b) const { return h[a] < h[b]; }
+    };
+    template <class T>
+    static void permute (std::vector<T> &v, const std::vector<uint32_t> &order) {
+        std::vector<T> sorted (v.size());
+        for (size_t i = 0; i < order.size(); i++)
+            sorted[i] = v[order[i]];
+        v.swap (sorted);
+    }
+public:
+    std::vector<uint64_t> hash, ino, stamp;
+    std::vector<uint8_t> dir;
+
+    static uint64_t name_hash (const char *s) {
+        uint64_t h = 14695981039346656037ULL;
+        while (*s)
+            h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+        return h;
+    }
+    static uint64_t make_stamp (const struct stat &st) {
+        return (st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec) ^ (st.st_size * 0x9e3779b97f4a7c15ULL);
+    }
+
+    void clear() {
+        arena.clear();
+        names.clear();
+        hash.clear();
+        ino.clear();
+        stamp.clear();
+        dir.clear();
+    }
+    void add (const char *name, uint64_t inode, uint64_t st, bool is_dir) {
+        names.push_back (arena.size());
+        arena.append (name, strlen (name) + 1);
+        hash.push_back (name_hash (name));
+        ino.push_back (inode);
+        stamp.push_back (st);
+        dir.push_back (is_dir);
+    }
+    // Put the entries in hash order, as snapshot_diff needs them. Call after the last add().
+    void sort() {
+        std::vector<uint32_t> order (hash.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::sort (order.begin(), order.end(), by_hash (hash));
+        permute (hash, order);
+        permute (ino, order);
+        permute (stamp, order);
+        permute (dir, order);
+        permute (names, order);
+    }
+    // Read directory path (sorted). False if it can't be opened.
+    bool list (const std::string &path) {
+        clear();
+        DIR *d = opendir (path.c_str());
+        if (!d)
+            return false;
+        while (struct dirent *de = readdir (d)) {
+            if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+                continue;
+            struct stat st;
+            if (fstatat (dirfd (d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            add (de->d_name, st.st_ino, make_stamp (st), S_ISDIR (st.st_mode));
+        }
+        closedir (d);
+        sort();
+        return true;
+    }
+    size_t size() const { return hash.size(); }
+    const char *name (size_t i) const { return arena.data() + names[i]; }
+    size_t usage() const {
+        return arena.capacity() + names.capacity() * 4 + (hash.capacity() + ino.capacity() + stamp.capacity()) * 8 +
+            dir.capacity();
+    }
+};
+
+struct SnapshotDiff {
+    std::vector<uint32_t> added;        // indices into the new snapshot
+    std::vector<uint32_t> removed;      // indices into the old one
+    std::vector<uint32_t> changed;      // indices into the new one: same inode, new stamp
+    size_t equal;                       // entries found equal in runs
+
+    void clear() {
+        added.clear();
+        removed.clear();
+        changed.clear();
+        equal = 0;
+    }
+};
+
+// How many entries, from a[i] and b[j] on, are equal in hash, inode and stamp.
+static inline size_t snapdiff_run_scalar (const Snapshot &a, size_t i, const Snapshot &b, size_t j)
+{
+    size_t n = 0;
+    while (i + n < a.size() && j + n < b.size() && a.hash[i + n] == b.hash[j + n] &&
+           a.ino[i + n] == b.ino[j + n] && a.stamp[i + n] == b.stamp[j + n])
+        n++;
+    return n;
+}
+
+#ifdef SNAPDIFF_X86
+static inline size_t snapdiff_run_sse2 (const Snapshot &a, size_t i, const Snapshot &b, size_t j)
+{
+    const uint64_t *ah = &a.hash[0], *ai = &a.ino[0], *as = &a.stamp[0];
+    const uint64_t *bh = &b.hash[0], *bi = &b.ino[0], *bs = &b.stamp[0];
+    size_t n = 0;
+    while (i + n + 2 <= a.size() && j + n + 2 <= b.size()) {
+        __m128i h = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) (ah + i + n)),
+                                     _mm_loadu_si128 ((const __m128i *) (bh + j + n)));
+        __m128i in = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) (ai + i + n)),
+                                      _mm_loadu_si128 ((const __m128i *) (bi + j + n)));
+        __m128i s = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) (as + i + n)),
+                                     _mm_loadu_si128 ((const __m128i *) (bs + j + n)));
+        int mask = _mm_movemask_epi8 (_mm_and_si128 (h, _mm_and_si128 (in, s)));
+        if (mask != 0xffff)
+            return n + ((mask & 0xff) == 0xff);
+        n += 2;
+    }
+    return n + snapdiff_run_scalar (a, i + n, b, j + n);
+}
+
+__attribute__ ((target ("avx2")))
+static inline size_t snapdiff_run_avx2 (const Snapshot &a, size_t i, const Snapshot &b, size_t j)
+{
+    const uint64_t *ah = &a.hash[0], *ai = &a.ino[0], *as = &a.stamp[0];
+    const uint64_t *bh = &b.hash[0], *bi = &b.ino[0], *bs = &b.stamp[0];
+    size_t n = 0;
+    while (i + n + 4 <= a.size() && j + n + 4 <= b.size()) {
+        __m256i h = _mm256_cmpeq_epi64 (_mm256_loadu_si256 ((const __m256i *) (ah + i + n)),
+                                        _mm256_loadu_si256 ((const __m256i *) (bh + j + n)));
+        __m256i in = _mm256_cmpeq_epi64 (_mm256_loadu_si256 ((const __m256i *) (ai + i + n)),
+                                         _mm256_loadu_si256 ((const __m256i *) (bi + j + n)));
+        __m256i s = _mm256_cmpeq_epi64 (_mm256_loadu_si256 ((const __m256i *) (as + i + n)),
+                                        _mm256_loadu_si256 ((const __m256i *) (bs + j + n)));
+        int mask = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_and_si256 (h, _mm256_and_si256 (in, s))));
+        if (mask != 0xf)
+            return n + __builtin_ctz (~mask);
+        n += 4;
+    }
+    return n + snapdiff_run_scalar (a, i + n, b, j + n);
+}
+#endif
+
+// The best implementation this CPU has.
+static inline snapdiff_impl snapdiff_best()
+{
+#ifdef SNAPDIFF_X86
+    if (__builtin_cpu_supports ("avx2"))
+        return SNAPDIFF_AVX2;
+    if (__builtin_cpu_supports ("sse2"))
+        return SNAPDIFF_SSE2;
+#endif
+    return SNAPDIFF_SCALAR;
+}
+
+static inline const char *snapdiff_name (snapdiff_impl impl)
+{
+    static const char *names[] = {"auto", "scalar", "sse2", "avx2"};
+    return names[impl];
+}
+
+// Diff two sorted snapshots. A name whose inode changed is both removed and added.
+// Returns the implementation used (impl, or the best there is for SNAPDIFF_AUTO).
+static inline snapdiff_impl snapshot_diff (const Snapshot &a, const Snapshot &b, SnapshotDiff &out,
+                                           snapdiff_impl impl = SNAPDIFF_AUTO)
+{
+    static const snapdiff_impl best = snapdiff_best();
+    if (impl == SNAPDIFF_AUTO || impl > best)
+        impl = best;
+    size_t (*run) (const Snapshot &, size_t, const Snapshot &, size_t) = snapdiff_run_scalar;
+#ifdef SNAPDIFF_X86
+    if (impl == SNAPDIFF_AVX2)
+        run = snapdiff_run_avx2;
+    else if (impl == SNAPDIFF_SSE2)
+        run = snapdiff_run_sse2;
+#endif
+    out.clear();
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        size_t n = run (a, i, b, j);
+        out.equal += n;
+        i += n;
+        j += n;
+        if (i == a.size() || j == b.size())
+            break;
+        if (a.hash[i] < b.hash[j]) {
+            out.removed.push_back (i++);
+        } else if (a.hash[i] > b.hash[j]) {
+            out.added.push_back (j++);
+        } else {
+            if (a.ino[i] != b.ino[j]) {
+                out.removed.push_back (i);
+                out.added.push_back (j);
+            } else {
+                out.changed.push_back (j);
+            }
+            i++;
+            j++;
+        }
+    }
+    for (; i < a.size(); i++)
+        out.removed.push_back (i);
+    for (; j < b.size(); j++)
+        out.added.push_back (j);
+    return impl;
+}
+
+#endif
@@ -0,0 +1,224 @@
+//
+// File:   subscriptions.h
+//
+// Subscriptions: many consumers watching the same tree for different things. Each
+// subscriber names a subtree (the wd of its top directory) and an event mask. The kernel is
+// asked, per directory, for only the union of what the subscriptions covering it want (plus
+// the watcher's own flags, which recursion needs), so directories nobody asked about for,
+// say, IN_MODIFY never generate those events in the first place.
+//
+// Masks are adjusted when subscriptions change: a directory whose union only grows gets the
+// new bits with IN_MASK_ADD, one that loses bits is watched again with the full new mask.
+// Directories created or walked later inherit their parent's mask in the bootstrap walker.
+//
+// Subscriptions is also the sink. Subscriptions hang off the Watch tree node they are rooted
+// at, so the tree is their trie: the subscribers of a directory are found by walking up its
+// parents, O(depth) however many subscriptions there are. The result (subscriber list and
+// union of their masks) is cached per wd, and a change only invalidates the subtree it is
+// rooted at. A directory created or deleted drops its own entry, so a wd the kernel hands out
+// again never finds its predecessor's subscribers. An event then costs one cache lookup, one
+// AND against the union, and a mask test per subscriber covering its directory. The cache is
+// rebuilt on demand, so it is dropped under memory pressure (membudget.h).
+//
+//    Watcher<InotifyBackend, Watch, AcceptAll, Subscriptions> w;
+//    int root = w.add_root ("./tmp");
+//    int id = w.sink().subscribe (w, root, IN_CLOSE_WRITE, &my_sink);
+//    ...
+//    w.sink().unsubscribe (w, id);
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef SUBSCRIPTIONS_H
+#define SUBSCRIPTIONS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+
+#include "watch.h"
+#include "watcher.h"
+#include "membudget.h"
+
+class Subscriptions {
+    struct subscription {
+        int root;               // wd of the subtree's top directory
+        uint32_t mask;
+        EventSink *sink;        // NULL: slot free
+    };
+    struct match {
+        uint32_t mask;          // union of the subscribers' masks
+        std::vector<int> ids;   // subscribers whose subtree holds the directory
+    };
+    std::vector<subscription> subs;
+    std::vector<int> free_ids;
+    std::unordered_map<int, std::vector<int> > rooted;     // wd -> subscriptions rooted there
+    std::unordered_map<int, match> cache;                   // wd -> its subscribers
+    std::unordered_map<int, std::set<int> > cached;         // parent wd -> its children in cache
+    const Watch *tree;
+    size_t active;
+    unsigned long delivered, updates, misses;
+
+    // Bring the kernel mask of every directory under root in line with the subscriptions,
+    // dropping what the cache knows about them first.
+    template <class W>
+    void apply (W &w, int root) {
+        std::vector<int> wds;
+        w.storage().subtree (root, wds);
+        for (size_t i = 0; i < wds.size(); i++) {
+            cache.erase (wds[i]);
+            cached.erase (wds[i]);
+        }
+        std::unordered_map<int, std::set<int> >::iterator pi = cached.find (w.storage().parent (root));
+        if (pi != cached.end())
+            pi->second.erase (root);
+        for (size_t i = 0; i < wds.size(); i++) {
+            uint32_t want = w.watch_flags() | matching (wds[i]).mask, have = w.mask (wds[i]);
+            if (want == have)
+                continue;
+            if (!(have & ~want))
+                w.set_mask (wds[i], want & ~have, true);
+            else
+                w.set_mask (wds[i], want);
+            updates++;
+        }
+    }
+public:
+    Subscriptions() : tree (NULL), active (0), delivered (0), updates (0), misses (0) {}
+
+    // Subscribe sink to events in mask for root and everything below it. Returns the
+    // subscription id.
+    template <class W>
+    int subscribe (W &w, int root, uint32_t mask, EventSink *sink) {
+        tree = &w.storage();
+        subscription s = {root, mask & IN_ALL_EVENTS, sink};
+        int id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+            subs[id] = s;
+        } else {
+            id = subs.size();
+            subs.push_back (s);
+        }
+        rooted[root].push_back (id);
+        active++;
+        apply (w, root);
+        return id;
+    }
+    template <class W>
+    void unsubscribe (W &w, int id) {
+        if (id < 0 || (size_t) id >= subs.size() || !subs[id].sink)
+            return;
+        int root = subs[id].root;
+        std::vector<int> &at = rooted[root];
+        for (size_t i = 0; i < at.size(); i++) {
+            if (at[i] == id) {
+                at.erase (at.begin() + i);
+                break;
+            }
+        }
+        if (at.empty())
+            rooted.erase (root);
+        subs[id].sink = NULL;
+        free_ids.push_back (id);
+        active--;
+        apply (w, root);
+    }
+
+    // The subscribers of wd: everything rooted at it or at one of its parents.
+    const match &matching (int wd) {
+        std::unordered_map<int, match>::iterator ci = cache.find (wd);
+        if (ci != cache.end())
+            return ci->second;
+        misses++;
+        match &m = cache[wd];
+        m.mask = 0;
+        if (tree)
+            cached[tree->parent (wd)].insert (wd);
+        for (int d = wd; d != -1 && tree; d = tree->parent (d)) {
+            std::unordered_map<int, std::vector<int> >::const_iterator ri = rooted.find (d);
+            if (ri == rooted.end())
+                continue;
+            for (size_t i = 0; i < ri->second.size(); i++) {
+                m.ids.push_back (ri->second[i]);
+                m.mask |= subs[ri->second[i]].mask;
+            }
+        }
+        return m;
+    }
+
+    // Sink policy.
+    void event (const std::string &dir, const struct inotify_event *event) {
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_DELETE)) && tree)
+            invalidate (event->wd, event->name);
+        const match &m = matching (event->wd);
+        if (!(m.mask & event->mask))
+            return;
+        for (size_t i = 0; i < m.ids.size(); i++) {
+            const subscription &s = subs[m.ids[i]];
+            if (s.mask & event->mask) {
+                s.sink->event (dir, event);
+                delivered++;
+            }
+        }
+    }
+    // A directory was created or deleted in pd: drop its entry. A new one is already in the
+    // tree; a deleted one is gone from it, so it is whichever cached child of pd is no longer.
+    void invalidate (int pd, const char *name) {
+        int wd = tree->child (pd, name);
+        if (wd >= 0)
+            cache.erase (wd);
+        std::unordered_map<int, std::set<int> >::iterator ci = cached.find (pd);
+        if (ci == cached.end())
+            return;
+        for (std::set<int>::iterator ki = ci->second.begin(); ki != ci->second.end(); ) {
+            if (*ki == wd || !tree->has (*ki)) {
+                cache.erase (*ki);
+                cached.erase (*ki);
+                ci->second.erase (ki++);
+            } else {
+                ki++;
+            }
+        }
+        if (ci->second.empty())
+            cached.erase (ci);
+    }
+    size_t cached_wds() const { return cache.size(); }
+    void overflow() {
+        for (size_t i = 0; i < subs.size(); i++)
+            if (subs[i].sink)
+                subs[i].sink->overflow();
+    }
+    void ready (const std::string &path, int wd, int dirs, int depth) {
+        const match &m = matching (wd);
+        for (size_t i = 0; i < m.ids.size(); i++)
+            subs[m.ids[i]].sink->ready (path, wd, dirs, depth);
+    }
+    void stats() {
+        printf ("subscriptions: %zu, %lu deliveries, %lu mask updates, %lu cache misses\n",
+                active, delivered, updates, misses);
+    }
+
+    // Memory budget hooks: the per-wd cache is dropped under PRESSURE_DROP_CACHES.
+    size_t usage() const {
+        size_t bytes = subs.capacity() * sizeof (subscription) + rooted.size() * 64;
+        for (std::unordered_map<int, match>::const_iterator ci = cache.begin(); ci != cache.end(); ci++)
+            bytes += 48 + ci->second.ids.capacity() * sizeof (int) + 40;
+        return bytes;
+    }
+    size_t relieve (int level, size_t) {
+        if (level != PRESSURE_DROP_CACHES)
+            return 0;
+        size_t bytes = usage();
+        cache.clear();
+        cached.clear();
+        return bytes - usage();
+    }
+};
+
+#endif
@@ -0,0 +1,274 @@
+//
+// File:   watch.h
+//
+// The Watch class from inotify-example.cpp: the default Storage policy of Watcher (watcher.h).
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+
+// Watch class keeps track of watch descriptors (wd), parent watch descriptors (pd), and names (from event->name).
+// The class provides some helpers for inotify, primarily to enable recursive monitoring:
+// 1. To add a watch (inotify_add_watch), a complete path is needed, but events only provide file/dir name with no path.
+// 2. Delete events provide parent watch descriptor and file/dir name, but removing the watch (infotify_rm_watch) needs a wd.
+//
+// Directories are also labeled in Euler-tour order: each one has an enter and an exit label,
+// and everything below it lies strictly between the two, so "is X under Y" is two integer
+// comparisons of labels (label()) instead of a walk up the parents; contains() does the same
+// from wds, at the cost of two O(log n) lookups. A new directory's labels go
+// halfway into the gap before its parent's exit label. When a gap is used up, the smallest
+// aligned range of label space around it that is sparse enough is relabeled evenly (the
+// order-maintenance scheme of Dietz and Bender et al.), so relabeling stays local and rare
+// however deep or wide the tree is.
+//
+class Watch {
+    struct wd_elem {
+        int pd;
+        std::string name;
+        uint64_t lo, hi;        // enter and exit labels
+        bool operator() (const wd_elem &l, const wd_elem &r) const
+            { return l.pd < r.pd ? true : l.pd == r.pd && l.name < r.name ? true : false; }
+    };
+    std::map<int, wd_elem> watch;
+    std::map<wd_elem, int, wd_elem> rwatch;
+    std::map<uint64_t, int> order;      // label -> wd * 2 (enter) or wd * 2 + 1 (exit)
+    unsigned long relabels;
+    unsigned long changes;              // inserts and erases so far
+
+    static const int LABEL_BITS = 62;
+    static const uint64_t LABEL_END = 1ULL << LABEL_BITS;       // exit label of the roots' parent
+
+    // Exit label of wd, LABEL_END for the roots' (or an unknown parent's) exit.
+    uint64_t exit (int wd) {
+        std::map<int, wd_elem>::iterator wi = watch.find (wd);
+        return wi == watch.end() ? LABEL_END : wi->second.hi;
+    }
+    void set (int token, uint64_t label) {
+        wd_elem &elem = watch[token >> 1];
+        (token & 1 ? elem.hi : elem.lo) = label;
+        order[label] = token;
+    }
+    // Spread the labels around label evenly over the smallest aligned range of 2^k labels
+    // holding fewer than (4/3)^k (one more included): the larger the range, the sparser it
+    // must be, which leaves gaps that last. (4/3)^62 is some 50 million labels.
+    void relabel (uint64_t label) {
+        relabels++;
+        double fits = 1;
+        for (int k = 1; k <= LABEL_BITS; k++) {
+            fits *= 4.0 / 3;
+            uint64_t size = 1ULL << k, base = label & ~(size - 1);
+            std::map<uint64_t, int>::iterator first = order.lower_bound (base), last = first;
+            size_t n = 0;
+            while (last != order.end() && last->first < base + size) {
+                last++;
+                n++;
+            }
+            if (n + 1 > fits && k < LABEL_BITS)
+                continue;
+            std::vector<int> tokens;
+            for (std::map<uint64_t, int>::iterator oi = first; oi != last; oi++)
+                tokens.push_back (oi->second);
+            order.erase (first, last);
+            uint64_t step = size / (n + 1);
+            for (size_t i = 0; i < tokens.size(); i++)
+                set (tokens[i], base + (i + 1) * step);
+            return;
+        }
+    }
+    // Give token a label just before the label of the one following it.
+    void place (int token, int parent) {
+        for (;;) {
+            uint64_t next = exit (parent);
+            std::map<uint64_t, int>::iterator oi = order.lower_bound (next);
+            uint64_t prev = oi == order.begin() ? 0 : (--oi)->first;
+            if (next - prev >= 2) {
+                set (token, prev + (next - prev) / 2);
+                return;
+            }
+            relabel (next == LABEL_END ? prev : next);
+        }
+    }
+    void label (int wd, int pd) {
+        place (wd * 2, pd);
+        place (wd * 2 + 1, pd);
+    }
+public:
+    Watch() : relabels (0), changes (0) {}
+    // Insert event information, used to create new watch, into Watch object.
+    void insert (int pd, const std::string &name, int wd) {
+        changes++;
+        std::map<int, wd_elem>::iterator wi = watch.find (wd);
+        if (wi == watch.end()) {
+            wd_elem elem = {pd, name, 0, 0};
+            watch[wd] = elem;
+            rwatch[elem] = wd;
+            label (wd, pd);
+            return;
+        }
+        rwatch.erase (wi->second);
+        bool moved = wi->second.pd != pd;
+        wi->second.pd = pd;
+        wi->second.name = name;
+        rwatch[wi->second] = wd;
+        if (!moved)
+            return;
+        // Moved under another parent: the subtree's labels move along, in order.
+        std::map<uint64_t, int>::iterator first = order.find (wi->second.lo), last = order.find (wi->second.hi);
+        std::vector<int> tokens;
+        for (last++; first != last; ) {
+            tokens.push_back (first->second);
+            order.erase (first++);
+        }
+        for (size_t i = 0; i < tokens.size(); i++)
+            place (tokens[i], pd);
+    }
+    // Erase watch specified by pd (parent watch descriptor) and name from watch list.
+    // Returns full name (for display etc), and wd, which is required for inotify_rm_watch.
+    // wd is -1 if the directory wasn't watched.
+    std::string erase (int pd, const std::string &name, int *wd) {
+        wd_elem pelem = {pd, name, 0, 0};
+        std::map<wd_elem, int, wd_elem>::iterator ri = rwatch.find (pelem);
+        if (ri == rwatch.end()) {
+            *wd = -1;
+            return name;
+        }
+        *wd = ri->second;
+        changes++;
+        rwatch.erase (ri);
+        const wd_elem &elem = watch[*wd];
+        std::string dir = elem.name;
+        order.erase (elem.lo);
+        order.erase (elem.hi);
+        watch.erase (*wd);
+        return dir;
+    }
+    // Given a watch descriptor, return the full directory name as string. Recurses up parent WDs to assemble name,
+    // an idea borrowed from Windows change journals.
+    std::string get (int wd) {
+        const wd_elem &elem = watch[wd];
+        return elem.pd == -1 ? elem.name : this->get (elem.pd) + "/" + elem.name;
+    }
+    // Given a parent wd and name (provided in IN_DELETE events), return the watch descriptor.
+    // Main purpose is to help remove directories from watch list.
+    int get (int pd, std::string name) {
+        wd_elem elem = {pd, name, 0, 0};
+        return rwatch[elem];
+    }
+    // The same without adding an entry: -1 if there is no such watch.
+    int child (int pd, const std::string &name) const {
+        wd_elem elem = {pd, name, 0, 0};
+        std::map<wd_elem, int, wd_elem>::const_iterator ri = rwatch.find (elem);
+        return ri == rwatch.end() ? -1 : ri->second;
+    }
+    // Parent wd of wd, -1 for a root or an unknown wd.
+    int parent (int wd) const {
+        std::map<int, wd_elem>::const_iterator wi = watch.find (wd);
+        return wi == watch.end() ? -1 : wi->second.pd;
+    }
+    // Name of wd in its parent, or the root's path.
+    std::string name (int wd) const {
+        std::map<int, wd_elem>::const_iterator wi = watch.find (wd);
+        return wi == watch.end() ? "" : wi->second.name;
+    }
+    // Append every wd.
+    void list (std::vector<int> &wds) const {
+        for (std::map<int, wd_elem>::const_iterator wi = watch.begin(); wi != watch.end(); wi++)
+            wds.push_back (wi->first);
+    }
+    size_t size() const { return watch.size(); }
+    bool has (int wd) const { return watch.count (wd) != 0; }
+    // Goes up with every insert and erase: callers caching something derived from the tree
+    // compare it to see whether the tree changed (selfwrites.h).
+    unsigned long generation() const { return changes; }
+    // Is wd ancestor itself or somewhere below it? Unknown wds are under nothing. The test
+    // itself is two comparisons, but finding both wds is O(log n): callers testing many wds
+    // against one ancestor should take its labels once with label().
+    bool contains (int ancestor, int wd) const {
+        std::map<int, wd_elem>::const_iterator ai = watch.find (ancestor), wi = watch.find (wd);
+        return ai != watch.end() && wi != watch.end() &&
+            ai->second.lo <= wi->second.lo && wi->second.hi <= ai->second.hi;
+    }
+    // The labels of wd, for callers that test many wds against one ancestor: wd is under
+    // ancestor if ancestor.lo <= wd.lo <= ancestor.hi.
+    bool label (int wd, uint64_t *lo, uint64_t *hi) const {
+        std::map<int, wd_elem>::const_iterator wi = watch.find (wd);
+        if (wi == watch.end())
+            return false;
+        *lo = wi->second.lo;
+        *hi = wi->second.hi;
+        return true;
+    }
+    // Append wd and every directory below it, in tree order.
+    void subtree (int wd, std::vector<int> &wds) const {
+        std::map<int, wd_elem>::const_iterator wi = watch.find (wd);
+        if (wi == watch.end())
+            return;
+        std::map<uint64_t, int>::const_iterator oi = order.find (wi->second.lo);
+        for (; oi != order.end() && oi->first <= wi->second.hi; oi++)
+            if (!(oi->second & 1))
+                wds.push_back (oi->second >> 1);
+    }
+    // Given an absolute path (as realpath gives it), return the wd watching that directory, or
+    // -1. Roots are matched by their real path, then one component at a time.
+    int lookup (const std::string &path) {
+        for (std::map<int, wd_elem>::iterator wi = watch.begin(); wi != watch.end(); wi++) {
+            if (wi->second.pd != -1)
+                continue;
+            char real[PATH_MAX];
+            if (!realpath (wi->second.name.c_str(), real))
+                continue;
+            size_t len = strlen (real);
+            if (path.compare (0, len, real) != 0 || (path.size() > len && path[len] != '/'))
+                continue;
+            int wd = wi->first;
+            for (size_t start = len + 1; start < path.size() && wd != -1; ) {
+                size_t end = path.find ('/', start);
+                if (end == std::string::npos)
+                    end = path.size();
+                wd_elem elem = {wd, path.substr (start, end - start), 0, 0};
+                std::map<wd_elem, int, wd_elem>::iterator ri = rwatch.find (elem);
+                wd = ri == rwatch.end() ? -1 : ri->second;
+                start = end + 1;
+            }
+            if (wd != -1)
+                return wd;
+        }
+        return -1;
+    }
+    template <class Backend>
+    void cleanup (Backend &in) {
+        for (std::map<int, wd_elem>::iterator wi = watch.begin(); wi != watch.end(); ) {
+            in.rm_watch (wi->first);
+            watch.erase (wi++);
+        }
+        changes++;
+        rwatch.clear();
+        order.clear();
+    }
+    // Rough bytes held, for the memory budget (membudget.h): four map nodes per watch. Nothing
+    // here can be dropped, the maps are what keeps recursion working.
+    size_t usage() const {
+        size_t bytes = 0;
+        for (std::map<int, wd_elem>::const_iterator wi = watch.begin(); wi != watch.end(); wi++)
+            bytes += 2 * (64 + sizeof (wd_elem) + wi->second.name.capacity()) + 2 * 48;
+        return bytes;
+    }
+    size_t relieve (int, size_t) { return 0; }
+    void stats() {
+        std::cout << "number of watches=" << watch.size() << " & reverse watches=" << rwatch.size()
+                  << " & relabels=" << relabels << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,491 @@
+//
+// File:   watcher.h
+//
+// The event loop from inotify-example.cpp as a header-only template, assembled from policies:
+//
+//    Watcher<Backend, Storage, Filter, Sink>
+//
+//    Backend   where events come from: InotifyBackend, FakeBackend (inotify-backend.h)
+//    Storage   wd <-> (pd, name) bookkeeping: Watch (watch.h)
+//    Filter    bool accept (const struct inotify_event *) decides what reaches the sink:
+//              AcceptAll, MaskFilter
+//    Sink      what happens to events: PrintSink, CountSink, NullSink, Subscriptions
+//              (subscriptions.h), EnrichSink (enrich.h)
+//
+// All policies are plain members called directly, so each deployment compiles exactly the
+// pipeline it assembles, with no virtual calls or unused features on the hot path. Filters
+// only gate delivery: directory bookkeeping (watching new directories, forgetting deleted
+// ones) always happens, so recursion keeps working whatever the filter rejects. Watched with
+// IN_MOVE, a directory renamed within the watched trees keeps its watches under the new name,
+// one moved in from outside is watched as if created, and one moved out is no longer watched.
+//
+// Events about the watcher's own output files are dropped before any of that (see
+// selfwrites.h and self()).
+//
+// For plugins that cannot know the policy types at compile time, WatcherInterface is a small
+// runtime-polymorphic facade over any Watcher, and VirtualSink forwards to an EventSink.
+//
+// This code sample is released into the Public Domain.
+//
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "inotify-backend.h"
+#include "inotify-bootstrap.h"
+#include "watch.h"
+#include "membudget.h"
+#include "selfwrites.h"
+
+#ifndef EVENT_SIZE
+#define EVENT_SIZE          (sizeof (struct inotify_event))
+#endif
+#ifndef EVENT_BUF_LEN
+#define EVENT_BUF_LEN       (1024 * (EVENT_SIZE + NAME_MAX + 1))
+#endif
+#ifndef WATCH_FLAGS
+#define WATCH_FLAGS         (IN_CREATE | IN_DELETE)
+#endif
+
+// --- Filters ---
+
+struct AcceptAll {
+    bool accept (const struct inotify_event *) const { return true; }
+};
+
+// Deliver only events with at least one bit of mask set.
+struct MaskFilter {
+    uint32_t mask;
+    MaskFilter() : mask (IN_ALL_EVENTS) {}
+    bool accept (const struct inotify_event *event) const { return (event->mask & mask) != 0; }
+};
+
+// --- Sinks ---
+// event (dir, event) gets every accepted event that names a file or directory, dir being the
+// full path of the directory it happened in. overflow() reports a lost event queue, ready()
+// bootstrap progress: depth 0 is the "fully covered" marker of a root, 1 a root's immediate
+// subdirectory, 2 anything deeper. A sink may also have flush(), called once the events of
+// one read have all been delivered, to work on them as a batch (enrich.h).
+
+struct NullSink {
+    void event (const std::string &, const struct inotify_event *) {}
+    void overflow() {}
+    void ready (const std::string &, int, int, int) {}
+    void stats() {}
+};
+
+// Keeps the totals the example prints, without printing each event.
+struct CountSink {
+    int total_file_events;
+    int total_dir_events;
+    int overflows;
+    CountSink() : total_file_events (0), total_dir_events (0), overflows (0) {}
+    void event (const std::string &, const struct inotify_event *event) {
+        int delta = event->mask & IN_CREATE ? 1 : event->mask & IN_DELETE ? -1 : 0;
+        if (event->mask & IN_ISDIR)
+            total_dir_events += delta;
+        else
+            total_file_events += delta;
+    }
+    void overflow() { overflows++; }
+    void ready (const std::string &, int, int, int) {}
+    void stats() {
+        std::cout << "total dir events = " << total_dir_events << ", total file events = " << total_file_events << std::endl;
+    }
+};
+
+// What inotify-example prints.
+struct PrintSink : CountSink {
+    void event (const std::string &dir, const struct inotify_event *event) {
+        CountSink::event (dir, event);
+        if (event->mask & IN_CREATE) {
+            if (event->mask & IN_ISDIR)
+                printf ("New directory %s/%s created.\n", dir.c_str(), event->name);
+            else
+                printf ("New file %s/%s created.\n", dir.c_str(), event->name);
+        } else if (event->mask & IN_DELETE) {
+            if (event->mask & IN_ISDIR)
+                printf ("Directory %s deleted.\n", event->name);
+            else
+                printf ("File %s/%s deleted.\n", dir.c_str(), event->name);
+        } else {
+            printf ("%s %s/%s changed (mask 0x%x).\n", event->mask & IN_ISDIR ? "Directory" : "File",
+                    dir.c_str(), event->name, event->mask);
+        }
+    }
+    void overflow() {
+        CountSink::overflow();
+        printf ("Overflow\n");
+    }
+    // Only the root and its immediate children are printed, a huge tree would flood the
+    // terminal otherwise.
+    void ready (const std::string &path, int, int dirs, int depth) {
+        if (depth == 0)
+            printf ("Root %s fully covered (%d directories).\n", path.c_str(), dirs);
+        else if (depth == 1)
+            printf ("Subtree %s watched (%d directories).\n", path.c_str(), dirs);
+    }
+};
+
+// Runtime-polymorphic sink, for plugins: Watcher<..., VirtualSink> w; w.sink().target = &mine;
+class EventSink {
+public:
+    virtual ~EventSink() {}
+    virtual void event (const std::string &dir, const struct inotify_event *event) = 0;
+    virtual void overflow() {}
+    virtual void ready (const std::string &, int, int, int) {}
+    virtual void stats() {}
+};
+
+struct VirtualSink {
+    EventSink *target;
+    VirtualSink() : target (NULL) {}
+    void event (const std::string &dir, const struct inotify_event *event) { if (target) target->event (dir, event); }
+    void overflow() { if (target) target->overflow(); }
+    void ready (const std::string &path, int wd, int dirs, int depth) { if (target) target->ready (path, wd, dirs, depth); }
+    void stats() { if (target) target->stats(); }
+};
+
+// Calls sink.flush() for sinks that have one.
+template <class S>
+inline auto flush_sink (S &sink, int) -> decltype (sink.flush(), void()) { sink.flush(); }
+template <class S>
+inline void flush_sink (S &, long) {}
+
+// --- Watcher ---
+
+template <class Backend, class Storage = Watch, class Filter = AcceptAll, class Sink = PrintSink>
+class Watcher {
+    Backend in;
+    Storage storage_;
+    Filter filter_;
+    Sink sink_;
+    SelfWrites self_;
+    uint32_t flags;
+    Bootstrap<Backend, Storage> boot;
+    std::map<std::string, int> roots;      // path -> wd
+    size_t read_len;        // how much of buffer reads may use; less under memory pressure
+    int pressure;
+    unsigned long shed;     // file events not delivered while shedding load
+    int from_pd;            // the last directory IN_MOVED_FROM: parent (-1: none), name, cookie
+    std::string from_name;
+    uint32_t from_cookie;
+    char buffer[ EVENT_BUF_LEN ];
+
+    // Bootstrap readiness, forwarded to the sink with its depth below the nearest root.
+    struct forward_ready {
+        Watcher *w;
+        void operator() (const std::string &path, int wd, int dirs) const {
+            int depth = 2;
+            if (w->roots.count (path))
+                depth = 0;
+            else if (w->roots.count (path.substr (0, path.rfind ('/'))))
+                depth = 1;
+            w->sink_.ready (path, wd, dirs, depth);
+        }
+    };
+public:
+    // walk: watch the directories that already exist under each root (see inotify-bootstrap.h).
+    // Scripted backends have no tree to walk.
+    explicit Watcher (uint32_t flags = WATCH_FLAGS, bool walk = true)
+        : flags (flags), boot (in, storage_, flags, walk), read_len (EVENT_BUF_LEN),
+          pressure (PRESSURE_NONE), shed (0), from_pd (-1), from_cookie (0) {}
+
+    Backend &backend() { return in; }
+    Storage &storage() { return storage_; }
+    Filter &filter() { return filter_; }
+    Sink &sink() { return sink_; }
+    // Our own output files and directories, whose events are dropped (selfwrites.h).
+    SelfWrites &self() { return self_; }
+
+    // Create the inotify instance; returns its fd (or 0 for backends without one), -1 on error.
+    int init() {
+        int fd = in.init();
+        if (fd < 0)
+            perror ("inotify_init");
+        return fd;
+    }
+
+    // Watch a root right away and queue the walk of what is already below it. Returns the
+    // root's wd, or -1 if it could not be watched.
+    int add_root (const char *root) {
+        int wd = boot.add_root (root);
+        roots[root] = wd;
+        return wd;
+    }
+    // The wd of a root, as given to add_root(), or -1.
+    int root (const char *root) const {
+        std::map<std::string, int>::const_iterator ri = roots.find (root);
+        return ri == roots.end() ? -1 : ri->second;
+    }
+    // Stop watching a root and everything below it, leaving the other roots alone. Events
+    // still queued for its directories are dropped as they arrive. Returns the number of
+    // watches removed, or -1 if root isn't one.
+    int remove_root (const char *root) {
+        std::map<std::string, int>::iterator ri = roots.find (root);
+        if (ri == roots.end())
+            return -1;
+        int removed = 0;
+        if (ri->second >= 0) {
+            boot.drop_root (ri->second);
+            removed = unwatch (ri->second);
+        }
+        roots.erase (ri);
+        return removed;
+    }
+
+    // wd is no longer watched (the kernel says so): drop it from the storage and the walker.
+    void forget (int wd) {
+        if (!storage_.has (wd))
+            return;
+        int pd = storage_.parent (wd), gone;
+        std::string name = storage_.name (wd);
+        if (pd == -1) {
+            boot.drop_root (wd);
+            std::map<std::string, int>::iterator ri = roots.find (name);
+            if (ri != roots.end() && ri->second == wd)
+                ri->second = -1;
+        } else {
+            boot.forget (pd, name);
+        }
+        storage_.erase (pd, name, &gone);
+    }
+
+    // Directory name under pd arrived by rename (IN_MOVED_TO): paired, it is the directory of
+    // the last IN_MOVED_FROM (same cookie), whose watch, and the paths of everything below it,
+    // follow. A directory moved in from outside, or one the walker hadn't watched yet, is
+    // handled as if created.
+    void moved (int pd, const std::string &name, bool paired) {
+        int wd = paired ? storage_.child (from_pd, from_name) : -1;
+        // Renamed over an (empty) directory, whose watch the kernel drops, or which the walker
+        // only had queued.
+        int replaced = storage_.child (pd, name);
+        if (replaced >= 0 && replaced != wd)
+            forget (replaced);
+        else if (replaced < 0)
+            boot.forget (pd, name);
+        if (wd >= 0) {
+            boot.moved (from_pd, from_name, pd, name);
+            storage_.insert (pd, name, wd);
+        } else {
+            if (paired)
+                boot.forget (from_pd, from_name);
+            boot.discovered (pd, name);
+        }
+        from_pd = -1;
+    }
+    // The directory of the last IN_MOVED_FROM left the watched trees (the kernel queues the
+    // IN_MOVED_TO of a rename right after it, and none came): stop watching it.
+    void moved_out() {
+        int wd = storage_.child (from_pd, from_name);
+        boot.forget (from_pd, from_name);
+        if (wd >= 0)
+            unwatch (wd);
+        from_pd = -1;
+    }
+    // Remove the watches of wd and everything below it from the storage and the kernel.
+    // Returns how many there were.
+    int unwatch (int wd) {
+        std::vector<int> wds;
+        storage_.subtree (wd, wds);
+        // Tree order backwards: children before their parents.
+        for (size_t i = wds.size(); i-- > 0; ) {
+            int gone;
+            storage_.erase (storage_.parent (wds[i]), storage_.name (wds[i]), &gone);
+            if (gone >= 0)
+                in.rm_watch (gone);
+        }
+        return wds.size();
+    }
+
+    // One turn of the loop: walk a slice of the tree, then wait up to timeout_ms (-1: forever)
+    // for events and handle what arrives. While walking, the wait is only a check, so events
+    // flow long before the walk is over. Returns the number of bytes of events handled, 0 if
+    // none arrived, or -1 once the backend has nothing more to give.
+    int poll (int timeout_ms = -1) {
+        forward_ready ready = {this};
+        bool walking = boot.step (64, ready) > 0;
+        if (!self_.empty())
+            self_.resolve (storage_);
+        int ready_fds = in.wait (walking ? 0 : timeout_ms);
+        if (ready_fds == 0)
+            return walking || timeout_ms >= 0 ? 0 : -1;
+        // Interrupted, e.g. by ctrl-c: let the caller check whether to go on.
+        if (ready_fds < 0)
+            return 0;
+
+        // Read event (s) from non-blocking inotify fd (non-blocking specified in inotify_init1).
+        int length = in.read (buffer, read_len);
+        if (length < 0) {
+            perror ("read");
+            return 0;
+        }
+        dispatch (buffer, length);
+        return length;
+    }
+
+    // The mask directories are watched with unless set_mask() changed it.
+    uint32_t watch_flags() const { return flags; }
+    // What the kernel reports for wd.
+    uint32_t mask (int wd) const { return boot.mask (wd); }
+    // Change what the kernel reports for one watched directory (see subscriptions.h): replace
+    // its mask, or with add, add to it (IN_MASK_ADD). Directories watched below it from then on
+    // inherit the new mask. Returns wd, or -1 on error.
+    int set_mask (int wd, uint32_t mask, bool add = false) {
+        std::string path = storage_.get (wd);
+        if (in.add_watch (path.c_str(), add ? mask | IN_MASK_ADD : mask) < 0) {
+            perror (path.c_str());
+            return -1;
+        }
+        boot.set_mask (wd, add ? boot.mask (wd) | mask : mask);
+        return wd;
+    }
+
+    // Read and handle whatever is queued right now, without waiting: the busy-poll path
+    // (busypoll.h). Returns the number of bytes of events handled, 0 if there were none.
+    int drain() {
+        int length = in.read (buffer, read_len);
+        if (length <= 0)
+            return 0;
+        dispatch (buffer, length);
+        return length;
+    }
+
+    // Directories still queued for the bootstrap walk; 0 once every root is covered.
+    size_t walking() const { return boot.queued(); }
+
+    // Keep going while running == true, or until the backend runs dry.
+    void run (const volatile bool &running) {
+        while (running && poll() >= 0)
+            ;
+    }
+
+    // Loop through an event buffer in the kernel's format.
+    void dispatch (const char *buf, int length) {
+        for (int i=0; i<length;) {
+            const struct inotify_event *event = (const struct inotify_event *) &buf[ i ];
+            i += EVENT_SIZE + event->len;
+            if (event->wd == -1 || event->mask & IN_Q_OVERFLOW) {
+                sink_.overflow();
+                continue;
+            }
+            if (from_pd >= 0 && !(event->mask & IN_MOVED_TO && event->cookie == from_cookie))
+                moved_out();
+            // The kernel dropped the watch: its directory is gone (IN_DELETE_SELF came first) or
+            // its filesystem was unmounted. Forget it, unless the parent's IN_DELETE already did;
+            // even our own directories, or their wds would stay in the storage for good.
+            if (event->mask & IN_IGNORED) {
+                forget (event->wd);
+                continue;
+            }
+            // Our own writes: drop them before anything else happens.
+            if (!self_.empty() && self_.drop (event->wd, event->len ? event->name : ""))
+                continue;
+            if (!event->len || !storage_.has (event->wd))
+                continue;
+            // Shedding load: keep the directory bookkeeping, drop the rest.
+            if (pressure >= PRESSURE_SHED_LOAD && !(event->mask & IN_ISDIR)) {
+                shed++;
+                continue;
+            }
+            std::string dir = storage_.get (event->wd);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & IN_CREATE) {
+                    // Watches it (unless the walker already found it) and queues its contents.
+                    // Out of watches (ENOSPC) or already gone: it stays unwatched.
+                    boot.discovered (event->wd, event->name);
+                } else if (event->mask & IN_DELETE) {
+                    int wd;
+                    boot.forget (event->wd, event->name);
+                    storage_.erase (event->wd, event->name, &wd);
+                    if (wd >= 0)
+                        in.rm_watch (wd);
+                } else if (event->mask & IN_MOVED_FROM) {
+                    from_pd = event->wd;
+                    from_name = event->name;
+                    from_cookie = event->cookie;
+                } else if (event->mask & IN_MOVED_TO) {
+                    moved (event->wd, event->name, from_pd >= 0 && event->cookie == from_cookie);
+                }
+            }
+            if (filter_.accept (event))
+                sink_.event (dir, event);
+        }
+        flush_sink (sink_, 0);
+    }
+
+    void stats() {
+        sink_.stats();
+        storage_.stats();
+        if (self_.count())
+            printf ("%lu events about our own files dropped\n", self_.count());
+        if (shed)
+            printf ("%lu events shed under memory pressure\n", shed);
+    }
+
+    // Memory budget hooks (membudget.h). Under PRESSURE_SHRINK_BUFFERS reads use a sixteenth of
+    // the event buffer and the rest is handed back to the kernel; under PRESSURE_SHED_LOAD only
+    // directory events are processed. PRESSURE_NONE restores both.
+    size_t usage() const {
+        return read_len + storage_.usage() + boot.usage();
+    }
+    size_t relieve (int level, size_t) {
+        pressure = level;
+        if (level == PRESSURE_NONE) {
+            read_len = EVENT_BUF_LEN;
+        } else if (level == PRESSURE_SHRINK_BUFFERS && read_len == EVENT_BUF_LEN) {
+            read_len = EVENT_BUF_LEN / 16;
+            long page = sysconf (_SC_PAGESIZE);
+            uintptr_t from = ((uintptr_t) buffer + read_len + page - 1) & ~(uintptr_t) (page - 1);
+            uintptr_t to = ((uintptr_t) buffer + EVENT_BUF_LEN) & ~(uintptr_t) (page - 1);
+            if (to > from && madvise ((void *) from, to - from, MADV_DONTNEED) == 0)
+                return to - from;
+        }
+        return 0;
+    }
+
+    // Remove all watches and close the instance.
+    void cleanup() {
+        storage_.cleanup (in);
+        in.close();
+    }
+};
+
+// --- Runtime-polymorphic facade ---
+
+class WatcherInterface {
+public:
+    virtual ~WatcherInterface() {}
+    virtual int init() = 0;
+    virtual int add_root (const char *root) = 0;
+    virtual int poll (int timeout_ms = -1) = 0;
+    virtual void stats() = 0;
+    virtual void cleanup() = 0;
+};
+
+// Wraps any Watcher, e.g. new DynamicWatcher<Watcher<InotifyBackend> >.
+template <class W>
+class DynamicWatcher : public WatcherInterface {
+    W w;
+public:
+    W &get() { return w; }
+    int init() { return w.init(); }
+    int add_root (const char *root) { return w.add_root (root); }
+    int poll (int timeout_ms = -1) { return w.poll (timeout_ms); }
+    void stats() { w.stats(); }
+    void cleanup() { w.cleanup(); }
+};
+
+#endif